@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2-alloc.h"
+
+/*
+	Several threads allocate inodes and blocks from one allocator until it
+	runs dry. Every number must come out exactly once, and the flushed
+	counts must match what was handed out.
+*/
+
+#define TEST_THREADS 4
+#define TEST_GROUPS 4
+#define TEST_IPG 512
+#define TEST_BLOCKS (FIRST_DATA_BLOCK + TEST_GROUPS * BLOCKS_PER_GROUP)
+#define TEST_INODES (TEST_GROUPS * TEST_IPG)
+
+struct tester
+{
+	pthread_t thread;
+	struct ext2_alloc *alloc;
+	u32 *inodes, *blocks;
+	u32 ninodes, nblocks, ndirs;
+};
+
+static void *tester_main(void *arg)
+{
+	struct tester *t = arg;
+	u32 parent = EXT2_ROOT_INO;
+	for (;;)
+	{
+		int is_dir = t->ninodes % 16 == 0;
+		u32 ino = ext2_alloc_inode(t->alloc, parent, is_dir);
+		if (ino == 0)
+			break;
+		t->inodes[t->ninodes++] = ino;
+		t->ndirs += is_dir;
+		if (is_dir)
+			parent = ino;
+		for (int k = 0; k < 8; k++)
+		{
+			u32 b = ext2_alloc_block(t->alloc, ino);
+			if (b)
+				t->blocks[t->nblocks++] = b;
+		}
+	}
+	/* what is left of the blocks */
+	for (u32 b; (b = ext2_alloc_block(t->alloc, parent)) != 0;)
+	{
+		t->blocks[t->nblocks++] = b;
+	}
+	return NULL;
+}
+
+/* every number in [first, first + count) handed out exactly once */
+static int check_unique(const char *what, struct tester *t, int inodes, u32 first, u32 count)
+{
+	unsigned char *seen = calloc(count, 1);
+	u32 total = 0;
+	int ret = 0;
+	for (int i = 0; i < TEST_THREADS; i++)
+	{
+		u32 n = inodes ? t[i].ninodes : t[i].nblocks;
+		const u32 *v = inodes ? t[i].inodes : t[i].blocks;
+		for (u32 k = 0; k < n; k++)
+		{
+			if (v[k] < first || v[k] >= first + count || seen[v[k] - first]++)
+			{
+				fprintf(stderr, "%s %u out of range or handed out twice\n", what, v[k]);
+				ret = 1;
+			}
+		}
+		total += n;
+	}
+	if (total != count)
+	{
+		fprintf(stderr, "%u %ss handed out, %u exist\n", total, what, count);
+		ret = 1;
+	}
+	free(seen);
+	return ret;
+}
+
+int main(void)
+{
+	static struct ext2_alloc alloc;
+	static struct ext2_block_group_descriptor gdt[TEST_GROUPS];
+	struct ext2_superblock sb;
+	struct tester t[TEST_THREADS] = {0};
+	int failed = 0;
+
+	if (ext2_alloc_init(&alloc, TEST_BLOCKS, TEST_INODES, FIRST_DATA_BLOCK, BLOCKS_PER_GROUP, TEST_IPG))
+	{
+		errno_exit("ext2_alloc_init");
+	}
+	for (int i = 0; i < TEST_THREADS; i++)
+	{
+		t[i].alloc = &alloc;
+		t[i].inodes = malloc(TEST_INODES * sizeof(u32));
+		t[i].blocks = malloc(TEST_BLOCKS * sizeof(u32));
+		if (t[i].inodes == NULL || t[i].blocks == NULL)
+		{
+			errno_exit("malloc");
+		}
+		if ((errno = pthread_create(&t[i].thread, NULL, tester_main, &t[i])) != 0)
+		{
+			errno_exit("pthread_create");
+		}
+	}
+	for (int i = 0; i < TEST_THREADS; i++)
+	{
+		pthread_join(t[i].thread, NULL);
+	}
+
+	failed |= check_unique("inode", t, 1, 1, TEST_INODES);
+	failed |= check_unique("block", t, 0, FIRST_DATA_BLOCK, TEST_BLOCKS - FIRST_DATA_BLOCK);
+
+	memset(&sb, 0, sizeof(sb));
+	ext2_alloc_flush(&alloc, &sb, gdt);
+	u32 dirs = 0, used_dirs = 0;
+	for (int i = 0; i < TEST_THREADS; i++)
+	{
+		dirs += t[i].ndirs;
+	}
+	for (int g = 0; g < TEST_GROUPS; g++)
+	{
+		if (gdt[g].bg_free_blocks_count || gdt[g].bg_free_inodes_count)
+		{
+			fprintf(stderr, "group %d still has %u free blocks, %u free inodes\n", g,
+					gdt[g].bg_free_blocks_count, gdt[g].bg_free_inodes_count);
+			failed = 1;
+		}
+		used_dirs += gdt[g].bg_used_dirs_count;
+	}
+	if (sb.s_free_blocks_count || sb.s_free_inodes_count || used_dirs != dirs)
+	{
+		fprintf(stderr, "flushed %u free blocks, %u free inodes, %u dirs (%u allocated)\n",
+				sb.s_free_blocks_count, sb.s_free_inodes_count, used_dirs, dirs);
+		failed = 1;
+	}
+
+	for (int i = 0; i < TEST_THREADS; i++)
+	{
+		free(t[i].inodes);
+		free(t[i].blocks);
+	}
+	ext2_alloc_destroy(&alloc);
+	if (!failed)
+	{
+		printf("ok: %d threads, %u inodes, %u blocks\n", TEST_THREADS, TEST_INODES, TEST_BLOCKS - FIRST_DATA_BLOCK);
+	}
+	return failed;
+}
@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2-alloc.h"
+
+static atomic_uint next_slot;
+static _Thread_local int my_slot = -1;
+
+static int slot(void)
+{
+	if (my_slot < 0)
+	{
+		my_slot = atomic_fetch_add(&next_slot, 1) % EXT2_ALLOC_SLOTS;
+	}
+	return my_slot;
+}
+
+static u32 hash32(u32 x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+/* first clear bit at or after hint (wrapping), -1 if none among bits */
+static int find_clear(const u8 *bitmap, u32 bits, u32 hint)
+{
+	for (u32 n = 0; n < bits;)
+	{
+		u32 i = (hint + n) % bits;
+		if (i % 8 == 0 && bitmap[i / 8] == 0xff && n + 8 <= bits)
+		{
+			n += 8;
+			continue;
+		}
+		if (!(bitmap[i / 8] & (1 << (i % 8))))
+		{
+			return i;
+		}
+		n++;
+	}
+	return -1;
+}
+
+int ext2_alloc_init(struct ext2_alloc *a, u32 nblocks, u32 ninodes, u32 first_data_block,
+					u32 blocks_per_group, u32 inodes_per_group)
+{
+	memset(a, 0, sizeof(*a));
+	if (blocks_per_group > BLOCK_SIZE * 8 || inodes_per_group > BLOCK_SIZE * 8)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	a->blocks_per_group = blocks_per_group;
+	a->inodes_per_group = inodes_per_group;
+	a->ngroups = (nblocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	if ((a->groups = calloc(a->ngroups, sizeof(*a->groups))) == NULL)
+	{
+		return -1;
+	}
+
+	for (u32 g = 0; g < a->ngroups; g++)
+	{
+		struct ext2_alloc_group *grp = &a->groups[g];
+		pthread_mutex_init(&grp->lock, NULL);
+		grp->first_block = first_data_block + g * blocks_per_group;
+
+		u32 blocks = nblocks - grp->first_block < blocks_per_group ? nblocks - grp->first_block : blocks_per_group;
+		u32 inodes = ninodes - g * inodes_per_group < inodes_per_group ? ninodes - g * inodes_per_group
+																	   : inodes_per_group;
+		/* bits past the end of the group are padding, always set */
+		for (u32 i = blocks; i < BLOCK_SIZE * 8; i++)
+			grp->block_bitmap[i / 8] |= 1 << (i % 8);
+		for (u32 i = inodes; i < BLOCK_SIZE * 8; i++)
+			grp->inode_bitmap[i / 8] |= 1 << (i % 8);
+		atomic_init(&grp->free_blocks, blocks);
+		atomic_init(&grp->free_inodes, inodes);
+		atomic_fetch_add(&a->slots[0].free_blocks, blocks);
+		atomic_fetch_add(&a->slots[0].free_inodes, inodes);
+	}
+	return 0;
+}
+
+void ext2_alloc_destroy(struct ext2_alloc *a)
+{
+	for (u32 g = 0; g < a->ngroups; g++)
+	{
+		pthread_mutex_destroy(&a->groups[g].lock);
+	}
+	free(a->groups);
+	a->groups = NULL;
+}
+
+/* claim one specific block, e.g. metadata at mkfs time */
+int ext2_alloc_mark_block(struct ext2_alloc *a, u32 block)
+{
+	u32 g = (block - a->groups[0].first_block) / a->blocks_per_group;
+	if (block < a->groups[0].first_block || g >= a->ngroups)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	struct ext2_alloc_group *grp = &a->groups[g];
+	u32 bit = block - grp->first_block;
+	int ret = 0;
+
+	pthread_mutex_lock(&grp->lock);
+	if (grp->block_bitmap[bit / 8] & (1 << (bit % 8)))
+	{
+		errno = EEXIST;
+		ret = -1;
+	}
+	else
+	{
+		grp->block_bitmap[bit / 8] |= 1 << (bit % 8);
+		atomic_fetch_sub_explicit(&grp->free_blocks, 1, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&grp->lock);
+	if (ret == 0)
+		atomic_fetch_sub(&a->slots[slot()].free_blocks, 1);
+	return ret;
+}
+
+int ext2_alloc_mark_inode(struct ext2_alloc *a, u32 ino, int is_dir)
+{
+	u32 g = (ino - 1) / a->inodes_per_group;
+	if (ino < 1 || g >= a->ngroups)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	struct ext2_alloc_group *grp = &a->groups[g];
+	u32 bit = (ino - 1) % a->inodes_per_group;
+	int ret = 0;
+
+	pthread_mutex_lock(&grp->lock);
+	if (grp->inode_bitmap[bit / 8] & (1 << (bit % 8)))
+	{
+		errno = EEXIST;
+		ret = -1;
+	}
+	else
+	{
+		grp->inode_bitmap[bit / 8] |= 1 << (bit % 8);
+		atomic_fetch_sub_explicit(&grp->free_inodes, 1, memory_order_relaxed);
+		grp->used_dirs += is_dir != 0;
+	}
+	pthread_mutex_unlock(&grp->lock);
+	if (ret == 0)
+		atomic_fetch_sub(&a->slots[slot()].free_inodes, 1);
+	return ret;
+}
+
+/* 0 when every group is full */
+u32 ext2_alloc_inode(struct ext2_alloc *a, u32 parent, int is_dir)
+{
+	u32 start = is_dir ? hash32(slot() + 1) % a->ngroups : (parent - 1) / a->inodes_per_group % a->ngroups;
+	for (u32 n = 0; n < a->ngroups; n++)
+	{
+		u32 g = (start + n) % a->ngroups;
+		struct ext2_alloc_group *grp = &a->groups[g];
+		/* peek without the lock, rechecked under it */
+		if (atomic_load_explicit(&grp->free_inodes, memory_order_relaxed) == 0)
+			continue;
+
+		pthread_mutex_lock(&grp->lock);
+		int bit = -1;
+		if (atomic_load_explicit(&grp->free_inodes, memory_order_relaxed) > 0)
+			bit = find_clear(grp->inode_bitmap, a->inodes_per_group, grp->inode_hint);
+		if (bit >= 0)
+		{
+			grp->inode_bitmap[bit / 8] |= 1 << (bit % 8);
+			grp->inode_hint = bit + 1;
+			atomic_fetch_sub_explicit(&grp->free_inodes, 1, memory_order_relaxed);
+			grp->used_dirs += is_dir != 0;
+		}
+		pthread_mutex_unlock(&grp->lock);
+
+		if (bit >= 0)
+		{
+			atomic_fetch_sub(&a->slots[slot()].free_inodes, 1);
+			return g * a->inodes_per_group + bit + 1;
+		}
+	}
+	errno = ENOSPC;
+	return 0;
+}
+
+/* a block in the inode's group if possible, 0 when the image is full */
+u32 ext2_alloc_block(struct ext2_alloc *a, u32 ino)
+{
+	u32 start = (ino - 1) / a->inodes_per_group % a->ngroups;
+	for (u32 n = 0; n < a->ngroups; n++)
+	{
+		u32 g = (start + n) % a->ngroups;
+		struct ext2_alloc_group *grp = &a->groups[g];
+		if (atomic_load_explicit(&grp->free_blocks, memory_order_relaxed) == 0)
+			continue;
+
+		pthread_mutex_lock(&grp->lock);
+		int bit = -1;
+		if (atomic_load_explicit(&grp->free_blocks, memory_order_relaxed) > 0)
+			bit = find_clear(grp->block_bitmap, a->blocks_per_group, grp->block_hint);
+		if (bit >= 0)
+		{
+			grp->block_bitmap[bit / 8] |= 1 << (bit % 8);
+			grp->block_hint = bit + 1;
+			atomic_fetch_sub_explicit(&grp->free_blocks, 1, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&grp->lock);
+
+		if (bit >= 0)
+		{
+			atomic_fetch_sub(&a->slots[slot()].free_blocks, 1);
+			return grp->first_block + bit;
+		}
+	}
+	errno = ENOSPC;
+	return 0;
+}
+
+/* fold the counters into the on-disk structures; either may be NULL */
+void ext2_alloc_flush(struct ext2_alloc *a, struct ext2_superblock *sb, struct ext2_block_group_descriptor *gdt)
+{
+	if (sb)
+	{
+		long long blocks = 0, inodes = 0;
+		for (int i = 0; i < EXT2_ALLOC_SLOTS; i++)
+		{
+			blocks += atomic_load(&a->slots[i].free_blocks);
+			inodes += atomic_load(&a->slots[i].free_inodes);
+		}
+		sb->s_free_blocks_count = blocks;
+		sb->s_free_inodes_count = inodes;
+	}
+	for (u32 g = 0; gdt && g < a->ngroups; g++)
+	{
+		struct ext2_alloc_group *grp = &a->groups[g];
+		pthread_mutex_lock(&grp->lock);
+		gdt[g].bg_free_blocks_count = atomic_load_explicit(&grp->free_blocks, memory_order_relaxed);
+		gdt[g].bg_free_inodes_count = atomic_load_explicit(&grp->free_inodes, memory_order_relaxed);
+		gdt[g].bg_used_dirs_count = grp->used_dirs;
+		pthread_mutex_unlock(&grp->lock);
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef EXT2_ALLOC_H
+#define EXT2_ALLOC_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ext2-headers.h"
+
+/*
+	Block/inode allocator safe to call from many writer threads at once.
+
+	Each group has its own lock, bitmaps and bg_* counters, so writers
+	working in different groups never touch the same lock. New directories
+	go to a group picked by hashing the calling thread, new files to the
+	group of their parent directory, probing onward when a group is full.
+
+	The filesystem-wide free counts are sums of per-thread slots padded to
+	a cache line each: allocating only bumps the caller's own slot, and
+	ext2_alloc_flush() adds the slots up when the superblock is written.
+*/
+
+#define EXT2_ALLOC_SLOTS 64
+
+struct ext2_alloc_group
+{
+	pthread_mutex_t lock;
+	u32 first_block; /* block number of bit 0 */
+	u8 block_bitmap[BLOCK_SIZE];
+	u8 inode_bitmap[BLOCK_SIZE];
+	u32 block_hint; /* bit to start the next search at */
+	u32 inode_hint;
+	/* written under the lock, atomic so the lock-free peeks are race free */
+	_Atomic u16 free_blocks;
+	_Atomic u16 free_inodes;
+	u16 used_dirs;
+};
+
+struct ext2_alloc_slot
+{
+	_Alignas(64) atomic_llong free_blocks;
+	atomic_llong free_inodes;
+};
+
+struct ext2_alloc
+{
+	u32 ngroups;
+	u32 blocks_per_group;
+	u32 inodes_per_group;
+	struct ext2_alloc_group *groups;
+	struct ext2_alloc_slot slots[EXT2_ALLOC_SLOTS];
+};
+
+int ext2_alloc_init(struct ext2_alloc *a, u32 nblocks, u32 ninodes, u32 first_data_block,
+					u32 blocks_per_group, u32 inodes_per_group);
+void ext2_alloc_destroy(struct ext2_alloc *a);
+int ext2_alloc_mark_block(struct ext2_alloc *a, u32 block);
+int ext2_alloc_mark_inode(struct ext2_alloc *a, u32 ino, int is_dir);
+u32 ext2_alloc_inode(struct ext2_alloc *a, u32 parent, int is_dir);
+u32 ext2_alloc_block(struct ext2_alloc *a, u32 ino);
+void ext2_alloc_flush(struct ext2_alloc *a, struct ext2_superblock *sb, struct ext2_block_group_descriptor *gdt);
+
+#endif /* EXT2_ALLOC_H */
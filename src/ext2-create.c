@@ -9,6 +9,31 @@
 #include <time.h>
 #include <unistd.h>
 #include "ext2-headers.h"
+#include "ext2-alloc.h"
+#include "ext2-dir.h"
+
+#define LARGE_DIR_NAME "large"
+#define EXT2_LINK_MAX 32000
+/* directories are mapped through the direct and single indirect blocks */
+#define MAX_DIR_BLOCKS (EXT2_NDIR_BLOCKS + BLOCK_SIZE / 4)
+
+/* a packed directory and the blocks it was placed in */
+struct dir_blocks
+{
+	u8 *data;
+	u32 nblocks;
+	u32 block[MAX_DIR_BLOCKS];
+	u32 indirect; /* 0 while the directory fits the direct blocks */
+};
+
+struct layout
+{
+	struct dir_blocks root;
+	struct dir_blocks lost_and_found;
+	struct dir_blocks large;
+	u32 large_ino; /* 0 unless a large directory was asked for */
+	u32 large_entries;
+};
 
 
 u32 get_current_time()
@@ -21,7 +46,7 @@ u32 get_current_time()
 	return t;
 }
 
-void write_superblock(int fd)
+void write_superblock(int fd, struct ext2_alloc *alloc, u16 state)
 {
 	off_t off = lseek(fd, BLOCK_OFFSET(SUPERBLOCK_BLOCKNO), SEEK_SET);
 	if (off == -1)
@@ -52,20 +77,18 @@ void write_superblock(int fd)
 	superblock.s_inodes_count = NUM_INODES;
 	superblock.s_blocks_count = NUM_BLOCKS;
 	superblock.s_r_blocks_count = 5 / 100 * NUM_BLOCKS;
-	superblock.s_free_blocks_count = NUM_FREE_BLOCKS;
-	superblock.s_free_inodes_count = NUM_FREE_INODES;
 	superblock.s_first_data_block = FIRST_DATA_BLOCK; /* First Data Block */
 	superblock.s_log_block_size = log_block_size;	  /* 1024 */
 	superblock.s_log_frag_size = log_fragment_size;	  /* 1024 */
 	superblock.s_blocks_per_group = BLOCKS_PER_GROUP;
 	superblock.s_frags_per_group = FRAGMENTS_PER_GROUP;
-	superblock.s_inodes_per_group = NUM_INODES / (1 + NUM_BLOCKS / BLOCKS_PER_GROUP);
+	superblock.s_inodes_per_group = INODES_PER_GROUP;
 	superblock.s_mtime = current_time;			/* Mount time */
 	superblock.s_wtime = current_time;			/* Write time */
 	superblock.s_mnt_count = 0;					/* Number of times mounted so far */
 	superblock.s_max_mnt_count = -1;		/* Make this unlimited */
 	superblock.s_magic = EXT2_SUPER_MAGIC;		/* ext2 Signature */
-	superblock.s_state = EXT2_VALID_FS;			/* File system is clean */
+	superblock.s_state = state;					/* EXT2_VALID_FS once everything else is on disk */
 	superblock.s_errors = EXT2_ERRORS_CONTINUE; /* Ignore the error (continue on) */
 	superblock.s_minor_rev_level = 0;			/* Leave this as 0 */
 	superblock.s_lastcheck = current_time;		/* Last check time */
@@ -96,6 +119,9 @@ void write_superblock(int fd)
 
 	memcpy(&superblock.s_volume_name, "hello", 5);
 
+	/* free counts come from the allocator */
+	ext2_alloc_flush(alloc, &superblock, NULL);
+
 	ssize_t size = sizeof(superblock);
 	if (write(fd, &superblock, size) != size)
 	{
@@ -103,7 +129,7 @@ void write_superblock(int fd)
 	}
 }
 
-void write_block_group_descriptor_table(int fd)
+void write_block_group_descriptor_table(int fd, struct ext2_alloc *alloc)
 {
 	off_t off = lseek(fd, BLOCK_OFFSET(BLOCK_GROUP_DESCRIPTOR_BLOCKNO), SEEK_SET);
 	if (off == -1)
@@ -111,73 +137,48 @@ void write_block_group_descriptor_table(int fd)
 		errno_exit("lseek");
 	}
 
-	struct ext2_block_group_descriptor block_group_descriptor = {0};
+	struct ext2_block_group_descriptor block_group_descriptor[NUM_GROUPS] = {0};
 
-	/* These are intentionally incorrectly set as 0, you should set them
-	   correctly and delete this comment */
-	block_group_descriptor.bg_block_bitmap = BLOCK_BITMAP_BLOCKNO;
-	block_group_descriptor.bg_inode_bitmap = INODE_BITMAP_BLOCKNO;
-	block_group_descriptor.bg_inode_table = INODE_TABLE_BLOCKNO;
-	block_group_descriptor.bg_free_blocks_count = NUM_FREE_BLOCKS;
-	block_group_descriptor.bg_free_inodes_count = NUM_FREE_INODES;
-	block_group_descriptor.bg_used_dirs_count = 2;
-	// block_group_descriptor. = 2;
+	block_group_descriptor[0].bg_block_bitmap = BLOCK_BITMAP_BLOCKNO;
+	block_group_descriptor[0].bg_inode_bitmap = INODE_BITMAP_BLOCKNO;
+	block_group_descriptor[0].bg_inode_table = INODE_TABLE_BLOCKNO;
+	ext2_alloc_flush(alloc, NULL, block_group_descriptor);
 
 	ssize_t size = sizeof(block_group_descriptor);
-	if (write(fd, &block_group_descriptor, size) != size)
+	if (write(fd, block_group_descriptor, size) != size)
 	{
 		errno_exit("write");
 	}
 }
 
-void set_bitmap(char * bitmap, uint16_t bit){
-	uint16_t bit_group = bit / 8;
-	uint16_t bit_offset = bit % 8;
-	bitmap[bit_group] = bitmap[bit_group] | (1 << bit_offset);
-}
-
-void write_block_bitmap(int fd)
+void write_block_bitmap(int fd, struct ext2_alloc *alloc)
 {
 	off_t off = lseek(fd, BLOCK_OFFSET(BLOCK_BITMAP_BLOCKNO), SEEK_SET);
 	if (off == -1)
 	{
 		errno_exit("lseek");
 	}
-	char initials[BLOCK_SIZE] ;
-	memset(initials, 0, BLOCK_SIZE);
-	for (size_t i = 0; i < LAST_BLOCK; i++)
-	{
-		set_bitmap(initials, i);
-	}
-	memset((initials + NUM_BLOCKS/8 - 1), 0x80, 1);
-	memset((initials + NUM_BLOCKS/8), 0xff, BLOCK_SIZE - NUM_BLOCKS/8);
-	if ((write(fd, initials, BLOCK_SIZE)) != BLOCK_SIZE)
+	/* bits past the last block are already set as padding by the allocator */
+	pthread_mutex_lock(&alloc->groups[0].lock);
+	ssize_t n = write(fd, alloc->groups[0].block_bitmap, BLOCK_SIZE);
+	pthread_mutex_unlock(&alloc->groups[0].lock);
+	if (n != BLOCK_SIZE)
 	{
 		errno_exit("write");
 	}
-	
 }
 
-
-
-void write_inode_bitmap(int fd)
+void write_inode_bitmap(int fd, struct ext2_alloc *alloc)
 {
 	off_t off = lseek(fd, BLOCK_OFFSET(INODE_BITMAP_BLOCKNO), SEEK_SET);
 	if (off == -1)
 	{
 		errno_exit("lseek");
 	}
-	char initials[BLOCK_SIZE] = {0};
-	for (size_t i = 0; i < 11; i++)
-	{
-		set_bitmap(initials, i);
-	}
-	set_bitmap(initials, LOST_AND_FOUND_INO);
-	set_bitmap(initials, HELLO_WORLD_INO);
-	// set_bitmap(initials, HELLO_INO);
-	memset((initials + NUM_INODES/8), 0xff, BLOCK_SIZE - NUM_INODES/8);
-	/* The first 11 bits in the bitmap should be considered as used in revision 0 of EXT2*/
-	if ((write(fd, initials , BLOCK_SIZE)) != BLOCK_SIZE)
+	pthread_mutex_lock(&alloc->groups[0].lock);
+	ssize_t n = write(fd, alloc->groups[0].inode_bitmap, BLOCK_SIZE);
+	pthread_mutex_unlock(&alloc->groups[0].lock);
+	if (n != BLOCK_SIZE)
 	{
 		errno_exit("write");
 	}
@@ -199,41 +200,55 @@ void write_inode(int fd, u32 index, struct ext2_inode *inode)
 	}
 }
 
-void write_inode_table(int fd)
+/* i_size, i_blocks and the block pointers of a directory inode */
+void set_dir_blocks(struct ext2_inode *inode, const struct dir_blocks *dir)
+{
+	inode->i_size = dir->nblocks * BLOCK_SIZE;
+	inode->i_blocks = (dir->nblocks + (dir->indirect != 0)) * (BLOCK_SIZE / 512); /* These are oddly 512 blocks */
+	for (u32 i = 0; i < dir->nblocks && i < EXT2_NDIR_BLOCKS; i++)
+	{
+		inode->i_block[i] = dir->block[i];
+	}
+	inode->i_block[EXT2_IND_BLOCK] = dir->indirect;
+}
+
+void write_inode_table(int fd, const struct layout *layout)
 {
 	u32 current_time = get_current_time();
 
 	struct ext2_inode lost_and_found_inode = {0};
 	lost_and_found_inode.i_mode = EXT2_S_IFDIR | EXT2_S_IRUSR | EXT2_S_IWUSR | EXT2_S_IXUSR | EXT2_S_IRGRP | EXT2_S_IXGRP | EXT2_S_IROTH | EXT2_S_IXOTH;
 	lost_and_found_inode.i_uid = 0;
-	lost_and_found_inode.i_size = 1024;
 	lost_and_found_inode.i_atime = current_time;
 	lost_and_found_inode.i_ctime = current_time;
 	lost_and_found_inode.i_mtime = current_time;
 	lost_and_found_inode.i_dtime = 0;
 	lost_and_found_inode.i_gid = 0;
 	lost_and_found_inode.i_links_count = 2;
-	lost_and_found_inode.i_blocks = 2; /* These are oddly 512 blocks */
-	lost_and_found_inode.i_block[0] = LOST_AND_FOUND_DIR_BLOCKNO;
+	set_dir_blocks(&lost_and_found_inode, &layout->lost_and_found);
 	write_inode(fd, LOST_AND_FOUND_INO, &lost_and_found_inode);
 
-	/* You should add your 3 other inodes in this function and delete this
-	   comment */
-
 	struct ext2_inode root_inode = {0};
 	root_inode.i_mode = EXT2_S_IFDIR | EXT2_S_IRUSR | EXT2_S_IWUSR | EXT2_S_IXUSR | EXT2_S_IRGRP | EXT2_S_IXGRP | EXT2_S_IROTH | EXT2_S_IXOTH;
 	root_inode.i_uid = 0;
-	root_inode.i_size = 1024;
 	root_inode.i_atime = current_time;
 	root_inode.i_ctime = current_time;
 	root_inode.i_mtime = current_time;
 	root_inode.i_dtime = 0;
 	root_inode.i_gid = 0;
-	root_inode.i_links_count = 3;
-	root_inode.i_blocks = 2;
-	root_inode.i_block[0] = ROOT_DIR_BLOCKNO;
+	root_inode.i_links_count = 3 + (layout->large_ino != 0);
+	set_dir_blocks(&root_inode, &layout->root);
 	write_inode(fd, EXT2_ROOT_INO, &root_inode);
 
+	if (layout->large_ino)
+	{
+		struct ext2_inode large_inode = root_inode;
+		large_inode.i_links_count = 2;
+		memset(large_inode.i_block, 0, sizeof(large_inode.i_block));
+		set_dir_blocks(&large_inode, &layout->large);
+		write_inode(fd, layout->large_ino, &large_inode);
+	}
+
 
 	struct ext2_inode hello_world_inode = {0};
 	hello_world_inode.i_mode = EXT2_S_IFREG | EXT2_S_IRUSR | EXT2_S_IWUSR | EXT2_S_IRGRP |  EXT2_S_IROTH ;
@@ -244,7 +259,7 @@ void write_inode_table(int fd)
 	hello_world_inode.i_mtime = current_time;
 	hello_world_inode.i_dtime = 0;
 	hello_world_inode.i_gid = 1000;
-	hello_world_inode.i_links_count = 1;
+	hello_world_inode.i_links_count = 1 + layout->large_entries; /* the large directory links to it */
 	hello_world_inode.i_blocks = 2;
 	hello_world_inode.i_block[0] = HELLO_WORLD_FILE_BLOCKNO;
 	write_inode(fd, HELLO_WORLD_INO, &hello_world_inode);
@@ -265,102 +280,248 @@ void write_inode_table(int fd)
 	write_inode(fd, HELLO_INO, &hello_inode);
 }
 
-void write_root_dir_block(int fd)
+void write_dir_blocks(int fd, const struct dir_blocks *dir)
+{
+	for (u32 i = 0; i < dir->nblocks; i++)
+	{
+		if (pwrite(fd, dir->data + i * BLOCK_SIZE, BLOCK_SIZE, BLOCK_OFFSET((off_t)dir->block[i])) != BLOCK_SIZE)
+		{
+			errno_exit("write");
+		}
+	}
+	if (dir->indirect)
+	{
+		u32 map[BLOCK_SIZE / 4] = {0};
+		memcpy(map, dir->block + EXT2_NDIR_BLOCKS, (dir->nblocks - EXT2_NDIR_BLOCKS) * sizeof(u32));
+		if (pwrite(fd, map, BLOCK_SIZE, BLOCK_OFFSET((off_t)dir->indirect)) != BLOCK_SIZE)
+		{
+			errno_exit("write");
+		}
+	}
+}
+
+void write_hello_world_file_block(int fd)
 {
-	/* This is all you */
-	off_t off = BLOCK_OFFSET(ROOT_DIR_BLOCKNO);
+	off_t off = BLOCK_OFFSET(HELLO_WORLD_FILE_BLOCKNO);
 	off = lseek(fd, off, SEEK_SET);
 	if (off == -1)
 	{
 		errno_exit("lseek");
 	}
-	ssize_t bytes_remaining = BLOCK_SIZE;
-
-	struct ext2_dir_entry current_entry = {0};
-	dir_entry_set(current_entry, EXT2_ROOT_INO, ".");
-	dir_entry_write(current_entry, fd);
-
-	bytes_remaining -= current_entry.rec_len;
-
-	struct ext2_dir_entry parent_entry = {0};
-	dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-	dir_entry_write(parent_entry, fd);
-
-	bytes_remaining -= parent_entry.rec_len;
-
-	struct ext2_dir_entry lost_found = {0};
-	dir_entry_set(lost_found, LOST_AND_FOUND_INO, "lost+found");
-	dir_entry_write(lost_found, fd);
-
-	bytes_remaining -= lost_found.rec_len;
-
-	struct ext2_dir_entry hello_entry = {0};
-	dir_entry_set(hello_entry, HELLO_INO, "hello");
-	dir_entry_write(hello_entry, fd);
-
-	bytes_remaining -= hello_entry.rec_len;
-
-
-	struct ext2_dir_entry hello_world_entry = {0};
-	dir_entry_set(hello_world_entry, HELLO_WORLD_INO, "hello-world");
-	dir_entry_write(hello_world_entry, fd);
+	// ssize_t bytes_remaining = BLOCK_SIZE;
+	char hello_world[] = "Hello world\n";
+	if (write(fd, hello_world, sizeof(hello_world)) != sizeof(hello_world))
+	{
+		errno_exit("write");
+	}
 
-	bytes_remaining -= hello_world_entry.rec_len;
+}
 
-	struct ext2_dir_entry fill_entry = {0};
-	fill_entry.rec_len = bytes_remaining;
-	dir_entry_write(fill_entry, fd);
+/* the layout below is fixed, so every allocation must land where expected */
+void expect_allocated(u32 got, u32 want, const char *what)
+{
+	if (got == 0)
+	{
+		errno_exit(what);
+	}
+	if (got != want)
+	{
+		fprintf(stderr, "%s: allocated %u, layout expects %u\n", what, got, want);
+		exit(1);
+	}
 }
 
-void write_lost_and_found_dir_block(int fd)
+/* pack dir and place it, starting at first_block when that is already reserved for it */
+void place_dir(struct ext2_alloc *alloc, struct ext2_dir *dir, enum ext2_dir_order order, u32 ino,
+			   u32 first_block, struct dir_blocks *out)
 {
-	off_t off = BLOCK_OFFSET(LOST_AND_FOUND_DIR_BLOCKNO);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1)
+	if (ext2_dir_pack(dir, order, &out->data, &out->nblocks))
 	{
-		errno_exit("lseek");
+		errno_exit("ext2_dir_pack");
+	}
+	ext2_dir_free(dir);
+	if (out->nblocks > MAX_DIR_BLOCKS)
+	{
+		fprintf(stderr, "directory %u needs %u blocks, at most %u fit\n", ino, out->nblocks, MAX_DIR_BLOCKS);
+		exit(1);
 	}
 
-	ssize_t bytes_remaining = BLOCK_SIZE;
+	for (u32 i = 0; i < out->nblocks; i++)
+	{
+		/* the indirect block goes between the direct and the indirect data blocks */
+		if (i == EXT2_NDIR_BLOCKS && (out->indirect = ext2_alloc_block(alloc, ino)) == 0)
+		{
+			errno_exit("ext2_alloc_block");
+		}
+		out->block[i] = i == 0 && first_block ? first_block : ext2_alloc_block(alloc, ino);
+		if (out->block[i] == 0)
+		{
+			errno_exit("ext2_alloc_block");
+		}
+	}
+}
 
-	struct ext2_dir_entry current_entry = {0};
-	dir_entry_set(current_entry, LOST_AND_FOUND_INO, ".");
-	dir_entry_write(current_entry, fd);
+void allocate_layout(struct ext2_alloc *alloc, struct layout *layout, u32 large_entries, enum ext2_dir_order order)
+{
+	if (ext2_alloc_init(alloc, NUM_BLOCKS, NUM_INODES, FIRST_DATA_BLOCK, BLOCKS_PER_GROUP, INODES_PER_GROUP))
+	{
+		errno_exit("ext2_alloc_init");
+	}
 
-	bytes_remaining -= current_entry.rec_len;
+	/* superblock, gdt, bitmaps and inode table */
+	u32 inode_table_blocks = INODES_PER_GROUP * sizeof(struct ext2_inode) / BLOCK_SIZE;
+	for (u32 b = SUPERBLOCK_BLOCKNO; b < INODE_TABLE_BLOCKNO + inode_table_blocks; b++)
+	{
+		if (ext2_alloc_mark_block(alloc, b))
+		{
+			errno_exit("ext2_alloc_mark_block");
+		}
+	}
+	/* reserved inodes of revision 0, root included */
+	for (u32 ino = 1; ino < EXT2_GOOD_OLD_FIRST_INO; ino++)
+	{
+		if (ext2_alloc_mark_inode(alloc, ino, ino == EXT2_ROOT_INO))
+		{
+			errno_exit("ext2_alloc_mark_inode");
+		}
+	}
 
-	struct ext2_dir_entry parent_entry = {0};
-	dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-	dir_entry_write(parent_entry, fd);
+	expect_allocated(ext2_alloc_inode(alloc, EXT2_ROOT_INO, 1), LOST_AND_FOUND_INO, "lost+found");
+	expect_allocated(ext2_alloc_inode(alloc, EXT2_ROOT_INO, 0), HELLO_WORLD_INO, "hello-world");
+	expect_allocated(ext2_alloc_inode(alloc, EXT2_ROOT_INO, 0), HELLO_INO, "hello");
+	expect_allocated(ext2_alloc_block(alloc, EXT2_ROOT_INO), ROOT_DIR_BLOCKNO, "root dir block");
+	expect_allocated(ext2_alloc_block(alloc, LOST_AND_FOUND_INO), LOST_AND_FOUND_DIR_BLOCKNO, "lost+found block");
+	expect_allocated(ext2_alloc_block(alloc, HELLO_WORLD_INO), HELLO_WORLD_FILE_BLOCKNO, "hello-world block");
+
+	struct ext2_dir root, lost_and_found;
+	if (ext2_dir_init(&root, EXT2_ROOT_INO, EXT2_ROOT_INO) || ext2_dir_add(&root, LOST_AND_FOUND_INO, "lost+found") ||
+		ext2_dir_add(&root, HELLO_INO, "hello") || ext2_dir_add(&root, HELLO_WORLD_INO, "hello-world") ||
+		ext2_dir_init(&lost_and_found, LOST_AND_FOUND_INO, EXT2_ROOT_INO))
+	{
+		errno_exit("ext2_dir_add");
+	}
 
-	bytes_remaining -= parent_entry.rec_len;
+	/* large_entries hard links to hello-world, for testing big directory scans */
+	if (large_entries > 0)
+	{
+		struct ext2_dir large;
+		if ((layout->large_ino = ext2_alloc_inode(alloc, EXT2_ROOT_INO, 1)) == 0)
+		{
+			errno_exit(LARGE_DIR_NAME);
+		}
+		layout->large_entries = large_entries;
+		if (ext2_dir_add(&root, layout->large_ino, LARGE_DIR_NAME) ||
+			ext2_dir_init(&large, layout->large_ino, EXT2_ROOT_INO))
+		{
+			errno_exit("ext2_dir_add");
+		}
+		for (u32 i = 0; i < large_entries; i++)
+		{
+			char name[16];
+			snprintf(name, sizeof(name), "f%u", i);
+			if (ext2_dir_add(&large, HELLO_WORLD_INO, name))
+			{
+				errno_exit("ext2_dir_add");
+			}
+		}
+		place_dir(alloc, &large, order, layout->large_ino, 0, &layout->large);
+	}
 
-	struct ext2_dir_entry fill_entry = {0};
-	fill_entry.rec_len = bytes_remaining;
-	dir_entry_write(fill_entry, fd);
+	place_dir(alloc, &root, order, EXT2_ROOT_INO, ROOT_DIR_BLOCKNO, &layout->root);
+	place_dir(alloc, &lost_and_found, order, LOST_AND_FOUND_INO, LOST_AND_FOUND_DIR_BLOCKNO,
+			  &layout->lost_and_found);
 }
 
-void write_hello_world_file_block(int fd)
+/*
+	Structures are written in stages so that a crash never leaves an image
+	that claims to be clean but points at data that was not written:
+
+		1. superblock marked not clean, gdt, bitmaps and file data
+		2. inode table
+		3. directory blocks
+		4. superblock with s_state = EXT2_VALID_FS
+
+	Each stage ends with one barrier, so durability costs four flushes no
+	matter how many structures a stage holds. sync_file_range() alone does
+	not persist the blocks allocated for the sparse image nor flush the
+	drive cache, so the barrier is fdatasync(); without durable it only
+	orders the writes in the page cache.
+*/
+struct write_order
 {
-	off_t off = BLOCK_OFFSET(HELLO_WORLD_FILE_BLOCKNO);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1)
+	int fd;
+	int durable;
+};
+
+void stage_barrier(struct write_order *w)
+{
+	if (w->durable && fdatasync(w->fd))
 	{
-		errno_exit("lseek");
+		errno_exit("fdatasync");
 	}
-	// ssize_t bytes_remaining = BLOCK_SIZE;
-	char hello_world[] = "Hello world\n";
-	write(fd, hello_world,sizeof(hello_world));
+}
 
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n] [-o name|hash|added] [-d entries]\n"
+					"  -n   skip the flushes between write stages (not crash safe)\n"
+					"  -o   order of directory entries (default name)\n"
+					"  -d   add /" LARGE_DIR_NAME " with that many links to hello-world\n",
+			prog);
+	exit(2);
 }
 
-int main()
+int main(int argc, char **argv)
 {
+	struct write_order order = {.durable = 1};
+	enum ext2_dir_order dir_order = EXT2_DIR_ORDER_NAME;
+	long large_entries = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "no:d:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			order.durable = 0;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "name"))
+				dir_order = EXT2_DIR_ORDER_NAME;
+			else if (!strcmp(optarg, "hash"))
+				dir_order = EXT2_DIR_ORDER_HASH;
+			else if (!strcmp(optarg, "added"))
+				dir_order = EXT2_DIR_ORDER_ADDED;
+			else
+				usage(argv[0]);
+			break;
+		case 'd':
+			large_entries = atol(optarg);
+			if (large_entries < 0 || large_entries >= EXT2_LINK_MAX)
+			{
+				fprintf(stderr, "%s: -d takes 0 to %d entries\n", argv[0], EXT2_LINK_MAX - 1);
+				exit(2);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+	{
+		usage(argv[0]);
+	}
+
+	/* everything that can fail on the layout fails before hello.img is touched */
+	static struct ext2_alloc alloc;
+	static struct layout layout;
+	allocate_layout(&alloc, &layout, large_entries, dir_order);
+
 	int fd = open("hello.img", O_CREAT | O_WRONLY, 0666);
 	if (fd == -1)
 	{
 		errno_exit("open");
 	}
+	order.fd = fd;
 
 	if (ftruncate(fd, 0))
 	{
@@ -371,18 +532,31 @@ int main()
 		errno_exit("ftruncate");
 	}
 
-	write_superblock(fd);
-	write_block_group_descriptor_table(fd);
-	write_block_bitmap(fd);
-	write_inode_bitmap(fd);
-	write_inode_table(fd);
-	write_root_dir_block(fd);
-	write_lost_and_found_dir_block(fd);
+	write_superblock(fd, &alloc, 0);
+	write_block_group_descriptor_table(fd, &alloc);
+	write_block_bitmap(fd, &alloc);
+	write_inode_bitmap(fd, &alloc);
 	write_hello_world_file_block(fd);
+	stage_barrier(&order);
+
+	write_inode_table(fd, &layout);
+	stage_barrier(&order);
+
+	write_dir_blocks(fd, &layout.root);
+	write_dir_blocks(fd, &layout.lost_and_found);
+	write_dir_blocks(fd, &layout.large);
+	stage_barrier(&order);
+
+	write_superblock(fd, &alloc, EXT2_VALID_FS);
+	stage_barrier(&order);
 
 	if (close(fd))
 	{
 		errno_exit("close");
 	}
+	ext2_alloc_destroy(&alloc);
+	free(layout.root.data);
+	free(layout.lost_and_found.data);
+	free(layout.large.data);
 	return 0;
 }
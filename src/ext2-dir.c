@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2-dir.h"
+#include "fs-arena.h"
+
+u32 ext2_dir_hash(const char *name, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)name;
+	u32 hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	while (len--)
+	{
+		u32 hash = hash1 + (hash0 ^ (*p++ * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+int ext2_dir_init(struct ext2_dir *d, u32 self, u32 parent)
+{
+	memset(d, 0, sizeof(*d));
+	if (ext2_dir_add(d, self, ".") < 0 || ext2_dir_add(d, parent, "..") < 0)
+	{
+		ext2_dir_free(d);
+		return -1;
+	}
+	return 0;
+}
+
+int ext2_dir_add(struct ext2_dir *d, u32 inode, const char *name)
+{
+	size_t len = strlen(name);
+	if (len == 0 || len > EXT2_NAME_LEN)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (array_grow(&d->items, &d->cap, d->count + 1, sizeof(*d->items)) < 0 ||
+		array_grow(&d->names, &d->names_cap, d->names_len + len, 1) < 0)
+	{
+		return -1;
+	}
+
+	struct ext2_dir_item *item = &d->items[d->count++];
+	item->name = NULL;
+	item->name_off = d->names_len;
+	item->name_len = len;
+	item->inode = inode;
+	item->hash = ext2_dir_hash(name, len);
+	memcpy(d->names + d->names_len, name, len);
+	d->names_len += len;
+	return 0;
+}
+
+static int by_name(const void *a, const void *b)
+{
+	const struct ext2_dir_item *x = a, *y = b;
+	int c = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+	return c ? c : (x->name_len > y->name_len) - (x->name_len < y->name_len);
+}
+
+static int by_hash(const void *a, const void *b)
+{
+	const struct ext2_dir_item *x = a, *y = b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return by_name(a, b);
+}
+
+int ext2_dir_pack(struct ext2_dir *d, enum ext2_dir_order order, u8 **blocks, u32 *nblocks)
+{
+	for (u32 i = 0; i < d->count; i++)
+	{
+		d->items[i].name = d->names + d->items[i].name_off;
+	}
+	/* "." and ".." stay in front */
+	if (order == EXT2_DIR_ORDER_NAME)
+		qsort(d->items + 2, d->count - 2, sizeof(*d->items), by_name);
+	else if (order == EXT2_DIR_ORDER_HASH)
+		qsort(d->items + 2, d->count - 2, sizeof(*d->items), by_hash);
+
+	/* first pass only counts blocks, the second fills them */
+	u32 n = 1, used = 0;
+	for (u32 i = 0; i < d->count; i++)
+	{
+		u32 rec_len = EXT2_DIR_REC_LEN(d->items[i].name_len);
+		if (used + rec_len > BLOCK_SIZE)
+		{
+			n++;
+			used = 0;
+		}
+		used += rec_len;
+	}
+	u8 *buf = calloc(n, BLOCK_SIZE);
+	if (buf == NULL)
+	{
+		return -1;
+	}
+
+	u8 *block = buf;
+	struct ext2_dir_entry *last = NULL;
+	used = 0;
+	for (u32 i = 0; i < d->count; i++)
+	{
+		const struct ext2_dir_item *item = &d->items[i];
+		u32 rec_len = EXT2_DIR_REC_LEN(item->name_len);
+		if (used + rec_len > BLOCK_SIZE)
+		{
+			last->rec_len += BLOCK_SIZE - used;
+			block += BLOCK_SIZE;
+			used = 0;
+		}
+		last = (struct ext2_dir_entry *)(block + used);
+		last->inode = item->inode;
+		last->rec_len = rec_len;
+		last->name_len = item->name_len;
+		memcpy(last->name, item->name, item->name_len);
+		used += rec_len;
+	}
+	last->rec_len += BLOCK_SIZE - used;
+
+	*blocks = buf;
+	*nblocks = n;
+	return 0;
+}
+
+void ext2_dir_free(struct ext2_dir *d)
+{
+	free(d->items);
+	free(d->names);
+	memset(d, 0, sizeof(*d));
+}
@@ -0,0 +1,50 @@
+#ifndef EXT2_DIR_H
+#define EXT2_DIR_H
+
+#include "ext2-headers.h"
+
+/*
+	Builds the blocks of one directory in memory. Every entry takes its
+	4-byte aligned minimum and the last entry of a block absorbs the slack,
+	so there is no filler entry and a directory spans as many blocks as its
+	entries need. "." and ".." always stay first; the rest is written in
+	the requested order.
+*/
+
+#define EXT2_DIR_REC_LEN(name_len) ((8 + (name_len) + 3) & ~3u)
+
+enum ext2_dir_order
+{
+	EXT2_DIR_ORDER_NAME,  /* bytewise, so listings need no sort */
+	EXT2_DIR_ORDER_HASH,  /* by ext2_dir_hash(), the order an htree index keys on */
+	EXT2_DIR_ORDER_ADDED, /* as ext2_dir_add() was called */
+};
+
+struct ext2_dir_item
+{
+	const char *name; /* set when packing, names may move while adding */
+	u32 name_off;
+	u32 inode;
+	u32 hash;
+	u32 name_len;
+};
+
+struct ext2_dir
+{
+	struct ext2_dir_item *items;
+	u32 count;
+	size_t cap;
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+};
+
+int ext2_dir_init(struct ext2_dir *d, u32 self, u32 parent);
+int ext2_dir_add(struct ext2_dir *d, u32 inode, const char *name);
+/* packed blocks, malloc'ed, *nblocks * BLOCK_SIZE bytes */
+int ext2_dir_pack(struct ext2_dir *d, enum ext2_dir_order order, u8 **blocks, u32 *nblocks);
+void ext2_dir_free(struct ext2_dir *d);
+/* the legacy htree hash (dx_hack_hash) */
+u32 ext2_dir_hash(const char *name, size_t len);
+
+#endif /* EXT2_DIR_H */
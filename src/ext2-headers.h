@@ -1,3 +1,6 @@
+#ifndef EXT2_HEADERS_H
+#define EXT2_HEADERS_H
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -12,8 +15,10 @@
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int16_t i16;
 typedef int32_t i32;
+typedef int64_t i64;
 
 #define BLOCK_SIZE 1024
 #define BLOCK_OFFSET(i) (i * BLOCK_SIZE)
@@ -51,6 +56,10 @@ typedef int32_t i32;
 #define EXT2_GOOD_OLD_FIRST_INO 11
 
 #define EXT2_GOOD_OLD_REV 0
+#define EXT2_DYNAMIC_REV 1
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
 
 #define EXT2_S_IFSOCK 0xC000
 #define EXT2_S_IFLNK 0xA000
@@ -87,8 +96,8 @@ typedef int32_t i32;
 #define HELLO_WORLD_FILE_BLOCKNO 23
 #define LAST_BLOCK HELLO_WORLD_FILE_BLOCKNO
 
-#define NUM_FREE_BLOCKS (NUM_BLOCKS - LAST_BLOCK - 1)
-#define NUM_FREE_INODES (NUM_INODES - LAST_INO)
+#define NUM_GROUPS ((NUM_BLOCKS - FIRST_DATA_BLOCK + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP)
+#define INODES_PER_GROUP (NUM_INODES / NUM_GROUPS)
 
 struct ext2_superblock
 {
@@ -125,9 +134,11 @@ struct ext2_superblock
 	u32 s_feature_ro_compat;
 	u8 s_uuid[16];
 	u8 s_volume_name[16];
-	u32 s_reserved[229];
+	u32 s_reserved[222]; /* pads the superblock to 1024 bytes */
 };
 
+_Static_assert(sizeof(struct ext2_superblock) == 1024, "superblock must fill exactly one 1K slot");
+
 struct ext2_block_group_descriptor
 {
 	u32 bg_block_bitmap;
@@ -189,30 +200,4 @@ struct ext2_dir_entry
 		exit(err);       \
 	} while (0)
 
-#define dir_entry_set(entry, inode_num, str)  \
-	do                                        \
-	{                                         \
-		char *s = str;                        \
-		size_t len = strlen(s);               \
-		entry.inode = inode_num;              \
-		entry.name_len = len;                 \
-		memcpy(&entry.name, s, len);          \
-		if ((len % 4) != 0)                   \
-		{                                     \
-			entry.rec_len = 12 + len / 4 * 4; \
-		}                                     \
-		else                                  \
-		{                                     \
-			entry.rec_len = 8 + len;          \
-		}                                     \
-	} while (0)
-
-#define dir_entry_write(entry, fd)           \
-	do                                       \
-	{                                        \
-		ssize_t size = entry.rec_len;        \
-		if (write(fd, &entry, size) != size) \
-		{                                    \
-			errno_exit("write");             \
-		}                                    \
-	} while (0)
+#endif /* EXT2_HEADERS_H */
@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs-arena.h"
+
+#define ALIGN_UP(n, a) (((n) + ((a) - 1)) & ~((size_t)(a) - 1))
+
+void arena_init(struct arena *a, size_t chunk_size)
+{
+	memset(a, 0, sizeof(*a));
+	a->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+}
+
+/* next chunk after the current one that can hold need bytes, allocating
+   (and linking in) a new one if the existing one is too small */
+static struct arena_chunk *arena_next_chunk(struct arena *a, size_t need)
+{
+	struct arena_chunk *next = a->current ? a->current->next : a->head;
+	if (next != NULL && next->size >= need)
+	{
+		next->used = 0;
+		return next;
+	}
+
+	size_t size = need > a->chunk_size ? need : a->chunk_size;
+	struct arena_chunk *c = malloc(sizeof(*c) + size);
+	if (c == NULL)
+	{
+		return NULL;
+	}
+	a->heap_calls++;
+	a->reserved += size;
+	c->size = size;
+	c->used = 0;
+	c->next = next;
+	if (a->current)
+	{
+		a->current->next = c;
+	}
+	else
+	{
+		a->head = c;
+	}
+	return c;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	size_t need = ALIGN_UP(size ? size : 1, ARENA_ALIGN);
+	struct arena_chunk *c = a->current;
+	if (c == NULL || c->size - c->used < need)
+	{
+		c = arena_next_chunk(a, need);
+		if (c == NULL)
+		{
+			return NULL;
+		}
+		a->current = c;
+	}
+
+	void *p = c->data + c->used;
+	c->used += need;
+	a->in_use += need;
+	if (a->in_use > a->peak)
+	{
+		a->peak = a->in_use;
+	}
+	return p;
+}
+
+void *arena_zalloc(struct arena *a, size_t size)
+{
+	void *p = arena_alloc(a, size);
+	if (p)
+	{
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len)
+{
+	char *p = arena_alloc(a, len + 1);
+	if (p)
+	{
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+struct arena_mark arena_mark(const struct arena *a)
+{
+	struct arena_mark m = {a->current, a->current ? a->current->used : 0, a->in_use};
+	return m;
+}
+
+void arena_rewind(struct arena *a, struct arena_mark mark)
+{
+	a->current = mark.chunk;
+	if (mark.chunk)
+	{
+		mark.chunk->used = mark.used;
+	}
+	a->in_use = mark.in_use;
+}
+
+void arena_reset(struct arena *a)
+{
+	a->current = NULL;
+	a->in_use = 0;
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_chunk *c = a->head;
+	while (c)
+	{
+		struct arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	a->head = a->current = NULL;
+	a->in_use = 0;
+	a->reserved = 0;
+}
+
+void arena_report(const struct arena *a, const char *what)
+{
+	fprintf(stderr, "%s: peak %zu bytes in use, %zu bytes reserved, %zu heap calls\n",
+			what, a->peak, a->reserved, a->heap_calls);
+}
+
+/* a slab lives as long as its arena's contents: re-init after arena_reset */
+void slab_init(struct slab *s, struct arena *a, size_t obj_size)
+{
+	s->arena = a;
+	s->obj_size = obj_size < sizeof(void *) ? sizeof(void *) : obj_size;
+	s->free_list = NULL;
+}
+
+void *slab_alloc(struct slab *s)
+{
+	if (s->free_list)
+	{
+		void *obj = s->free_list;
+		memcpy(&s->free_list, obj, sizeof(void *));
+		return obj;
+	}
+	return arena_alloc(s->arena, s->obj_size);
+}
+
+void slab_free(struct slab *s, void *obj)
+{
+	memcpy(obj, &s->free_list, sizeof(void *));
+	s->free_list = obj;
+}
+
+int array_grow(void *pp, size_t *cap, size_t need, size_t elem)
+{
+	void **p = pp;
+	if (need <= *cap)
+	{
+		return 0;
+	}
+	size_t n = *cap ? *cap : 64;
+	while (n < need)
+		n *= 2;
+	if (n > SIZE_MAX / elem)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	void *q = realloc(*p, n * elem);
+	if (q == NULL)
+	{
+		return -1;
+	}
+	*p = q;
+	*cap = n;
+	return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef FS_ARENA_H
+#define FS_ARENA_H
+
+#include <stddef.h>
+
+/*
+	Bump allocator for one explorer operation (a walk, a lookup, ...).
+	Everything handed out is released at once with arena_reset(), which
+	keeps the chunks around so the next operation runs without touching
+	the heap again. arena_mark()/arena_rewind() give stack-like release
+	inside an operation, e.g. per directory level of a walk.
+*/
+
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t size; /* usable bytes in data[] */
+	size_t used;
+	unsigned char data[];
+};
+
+struct arena
+{
+	struct arena_chunk *head;
+	struct arena_chunk *current;
+	size_t chunk_size;
+	size_t in_use;	 /* bytes handed out since the last reset */
+	size_t peak;	 /* high-water mark of in_use */
+	size_t reserved; /* bytes held in chunks */
+	size_t heap_calls;
+};
+
+struct arena_mark
+{
+	struct arena_chunk *chunk;
+	size_t used;
+	size_t in_use;
+};
+
+void arena_init(struct arena *a, size_t chunk_size);
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_zalloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+struct arena_mark arena_mark(const struct arena *a);
+void arena_rewind(struct arena *a, struct arena_mark mark);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+void arena_report(const struct arena *a, const char *what);
+
+/*
+	Fixed-size object cache on top of an arena. Freed objects go on a
+	free list and are handed back out before the arena is asked again.
+*/
+struct slab
+{
+	struct arena *arena;
+	size_t obj_size;
+	void *free_list;
+};
+
+void slab_init(struct slab *s, struct arena *a, size_t obj_size);
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+
+/*
+	Heap arrays that outlive any arena: make *pp (an array of *cap elements
+	of elem bytes) hold at least need elements, doubling as it goes.
+*/
+int array_grow(void *pp, size_t *cap, size_t need, size_t elem);
+
+#endif /* FS_ARENA_H */
@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs-arena.h"
+#include "fs-catalog.h"
+#include "fs-io.h"
+#include "fs-plan.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/*
+	A pool of workers takes images off a shared counter. Each image is
+	opened once (one fd) and walked through its own read planner. Its
+	regular files are then hashed in order of their first block, once per
+	inode however many links it has, reusing the planner's staging buffer:
+	memory per image in flight is bounded by FS_CATALOG_BUDGET plus the
+	file list. Results stay per image until every worker is done, then the
+	main thread writes the columns in the order the images were given.
+*/
+
+static const u32 column_width[FS_CATALOG_COLUMNS] = {
+	[FS_CAT_IMAGE_PATH] = 8,		[FS_CAT_IMAGE_PATH_LEN] = 4,	[FS_CAT_IMAGE_STATUS] = 4,
+	[FS_CAT_IMAGE_BLOCK_SIZE] = 4,	[FS_CAT_IMAGE_BLOCKS] = 4,		[FS_CAT_IMAGE_INODES] = 4,
+	[FS_CAT_IMAGE_FREE_BLOCKS] = 4, [FS_CAT_IMAGE_FREE_INODES] = 4, [FS_CAT_IMAGE_GROUPS] = 4,
+	[FS_CAT_IMAGE_FILE_FIRST] = 8,	[FS_CAT_IMAGE_FILE_COUNT] = 4,	[FS_CAT_FILE_IMAGE] = 4,
+	[FS_CAT_FILE_PATH] = 8,			[FS_CAT_FILE_PATH_LEN] = 4,		[FS_CAT_FILE_INO] = 4,
+	[FS_CAT_FILE_MODE] = 4,			[FS_CAT_FILE_SIZE] = 8,			[FS_CAT_FILE_HASH] = 8,
+};
+
+struct catalog_file
+{
+	u64 size;
+	u64 hash;
+	u32 path_off; /* into the image's strings */
+	u32 path_len;
+	u32 ino;
+	u32 mode;
+};
+
+struct catalog_image
+{
+	const char *path;
+	int status;
+	u32 block_size, blocks, inodes, free_blocks, free_inodes, groups;
+	struct catalog_file *files;
+	u32 nfiles;
+	char *strings;
+	size_t strings_len;
+};
+
+/* a file found by the walk, with the inode it is hashed from */
+struct catalog_entry
+{
+	struct catalog_file file;
+	const char *path; /* set once the walk is done, the strings may move until then */
+	u32 first_block;
+	struct ext2_inode inode;
+};
+
+struct catalog
+{
+	struct catalog_image *images;
+	size_t count;
+	atomic_size_t next;
+	atomic_ullong bytes_hashed;
+};
+
+struct catalog_worker
+{
+	pthread_t thread;
+	struct catalog *c;
+	struct arena image; /* what fs_open() keeps, reset per image */
+	struct arena scratch;
+	struct catalog_entry *entries;
+	size_t nentries, entries_cap;
+	char *strings;
+	size_t strings_len, strings_cap;
+};
+
+static int catalog_add(void *ctx, const char *path, size_t path_len, u32 ino, const struct ext2_inode *inode)
+{
+	struct catalog_worker *w = ctx;
+	if (array_grow(&w->entries, &w->entries_cap, w->nentries + 1, sizeof(*w->entries)) < 0 ||
+		array_grow(&w->strings, &w->strings_cap, w->strings_len + path_len + 1, 1) < 0)
+	{
+		return -1;
+	}
+	if (w->strings_len + path_len + 1 > UINT32_MAX)
+	{
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	struct catalog_entry *e = &w->entries[w->nentries++];
+	e->file.size = fs_inode_size(inode);
+	e->file.hash = 0;
+	e->file.path_off = w->strings_len;
+	e->file.path_len = path_len;
+	e->file.ino = ino;
+	e->file.mode = inode->i_mode;
+	e->first_block = inode->i_block[0];
+	e->inode = *inode;
+	memcpy(w->strings + w->strings_len, path, path_len + 1);
+	w->strings_len += path_len + 1;
+	return 0;
+}
+
+/* disk order; the links of one inode end up next to each other */
+static int by_first_block(const void *a, const void *b)
+{
+	const struct catalog_entry *x = a, *y = b;
+	if (x->first_block != y->first_block)
+		return x->first_block < y->first_block ? -1 : 1;
+	return (x->file.ino > y->file.ino) - (x->file.ino < y->file.ino);
+}
+
+static int by_path(const void *a, const void *b)
+{
+	const struct catalog_entry *x = a, *y = b;
+	return strcmp(x->path, y->path);
+}
+
+static int catalog_hash(const struct fs_image *img, struct catalog_entry *e, unsigned char *buf, size_t len,
+						u64 *hashed)
+{
+	u64 h = FNV_OFFSET;
+	for (u64 off = 0; off < e->file.size;)
+	{
+		ssize_t n = fs_read(img, &e->inode, off, buf, len);
+		if (n < 0)
+		{
+			return -1;
+		}
+		if (n == 0)
+		{
+			break;
+		}
+		for (ssize_t i = 0; i < n; i++)
+		{
+			h = (h ^ buf[i]) * FNV_PRIME;
+		}
+		off += n;
+		*hashed += n;
+	}
+	e->file.hash = h;
+	return 0;
+}
+
+static int catalog_scan(struct catalog_worker *w, struct catalog_image *ci, const struct fs_image *img)
+{
+	struct fs_plan plan;
+	u64 hashed = 0;
+	int ret = -1;
+
+	if (fs_plan_init(&plan, img, FS_PLAN_MAX_GAP, FS_CATALOG_BUDGET) < 0)
+	{
+		return -1;
+	}
+	w->nentries = 0;
+	w->strings_len = 0;
+	if (fs_walk_planned(img, "/", -1, &w->scratch, &plan, catalog_add, w) != 0)
+	{
+		goto out;
+	}
+
+	/* contents in disk order, the walk's staging buffer is free again */
+	qsort(w->entries, w->nentries, sizeof(*w->entries), by_first_block);
+	for (size_t i = 0; i < w->nentries; i++)
+	{
+		struct catalog_entry *e = &w->entries[i];
+		if (!fs_is_reg(&e->inode))
+		{
+			continue;
+		}
+		/* another link to the inode just hashed */
+		if (i > 0 && e[-1].file.ino == e->file.ino)
+		{
+			e->file.hash = e[-1].file.hash;
+			continue;
+		}
+		if (catalog_hash(img, e, plan.staging, plan.max_read, &hashed) < 0)
+		{
+			goto out;
+		}
+	}
+
+	for (size_t i = 0; i < w->nentries; i++)
+	{
+		w->entries[i].path = w->strings + w->entries[i].file.path_off;
+	}
+	qsort(w->entries, w->nentries, sizeof(*w->entries), by_path);
+
+	if ((ci->files = malloc((w->nentries ? w->nentries : 1) * sizeof(*ci->files))) == NULL ||
+		(ci->strings = malloc(w->strings_len ? w->strings_len : 1)) == NULL)
+	{
+		goto out;
+	}
+	for (size_t i = 0; i < w->nentries; i++)
+	{
+		ci->files[i] = w->entries[i].file;
+	}
+	ci->nfiles = w->nentries;
+	memcpy(ci->strings, w->strings, w->strings_len);
+	ci->strings_len = w->strings_len;
+	atomic_fetch_add(&w->c->bytes_hashed, hashed);
+	ret = 0;
+
+out:
+	fs_plan_free(&plan);
+	return ret;
+}
+
+static void *catalog_worker(void *arg)
+{
+	struct catalog_worker *w = arg;
+	struct catalog *c = w->c;
+	for (;;)
+	{
+		size_t i = atomic_fetch_add(&c->next, 1);
+		if (i >= c->count)
+			break;
+
+		struct catalog_image *ci = &c->images[i];
+		struct fs_image img;
+		arena_reset(&w->image);
+		arena_reset(&w->scratch);
+		if (fs_open(&img, ci->path, &w->image) < 0)
+		{
+			ci->status = errno ? errno : EINVAL;
+			continue;
+		}
+		ci->block_size = img.block_size;
+		ci->blocks = img.super.s_blocks_count;
+		ci->inodes = img.super.s_inodes_count;
+		ci->free_blocks = img.super.s_free_blocks_count;
+		ci->free_inodes = img.super.s_free_inodes_count;
+		ci->groups = img.groups;
+		if (catalog_scan(w, ci, &img) < 0)
+		{
+			ci->status = errno ? errno : EIO;
+			free(ci->files);
+			free(ci->strings);
+			ci->files = NULL;
+			ci->strings = NULL;
+			ci->nfiles = 0;
+			ci->strings_len = 0;
+		}
+		fs_close(&img);
+	}
+	return NULL;
+}
+
+#define PUT32(col, row, v) (((u32 *)data[col])[row] = (v))
+#define PUT64(col, row, v) (((u64 *)data[col])[row] = (v))
+
+static int write_catalog(const struct catalog *c, const char *out)
+{
+	struct fs_catalog_header hdr = {0};
+	void *data[FS_CATALOG_COLUMNS] = {0};
+	int ret = -1;
+
+	hdr.magic = FS_CATALOG_MAGIC;
+	hdr.version = FS_CATALOG_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.column_count = FS_CATALOG_COLUMNS;
+	hdr.image_count = c->count;
+	for (size_t i = 0; i < c->count; i++)
+	{
+		hdr.file_count += c->images[i].nfiles;
+		hdr.strings_size += strlen(c->images[i].path) + 1 + c->images[i].strings_len;
+	}
+
+	u64 pos = ALIGN8(sizeof(hdr));
+	for (int col = 0; col < FS_CATALOG_COLUMNS; col++)
+	{
+		u64 rows = col >= FS_CAT_FILE_IMAGE ? hdr.file_count : hdr.image_count;
+		hdr.columns[col].off = pos;
+		hdr.columns[col].width = column_width[col];
+		hdr.columns[col].per_file = col >= FS_CAT_FILE_IMAGE;
+		pos = ALIGN8(pos + rows * column_width[col]);
+		if ((data[col] = malloc(rows ? rows * column_width[col] : 1)) == NULL)
+		{
+			goto out;
+		}
+	}
+	hdr.strings_off = pos;
+	hdr.file_size = ALIGN8(pos + hdr.strings_size);
+
+	/* strings are each image's path followed by the paths of its files */
+	u64 str = 0, row = 0;
+	for (size_t i = 0; i < c->count; i++)
+	{
+		const struct catalog_image *ci = &c->images[i];
+		size_t len = strlen(ci->path);
+		PUT64(FS_CAT_IMAGE_PATH, i, str);
+		PUT32(FS_CAT_IMAGE_PATH_LEN, i, len);
+		PUT32(FS_CAT_IMAGE_STATUS, i, ci->status);
+		PUT32(FS_CAT_IMAGE_BLOCK_SIZE, i, ci->block_size);
+		PUT32(FS_CAT_IMAGE_BLOCKS, i, ci->blocks);
+		PUT32(FS_CAT_IMAGE_INODES, i, ci->inodes);
+		PUT32(FS_CAT_IMAGE_FREE_BLOCKS, i, ci->free_blocks);
+		PUT32(FS_CAT_IMAGE_FREE_INODES, i, ci->free_inodes);
+		PUT32(FS_CAT_IMAGE_GROUPS, i, ci->groups);
+		PUT64(FS_CAT_IMAGE_FILE_FIRST, i, row);
+		PUT32(FS_CAT_IMAGE_FILE_COUNT, i, ci->nfiles);
+		str += len + 1;
+		for (u32 k = 0; k < ci->nfiles; k++, row++)
+		{
+			const struct catalog_file *f = &ci->files[k];
+			PUT32(FS_CAT_FILE_IMAGE, row, i);
+			PUT64(FS_CAT_FILE_PATH, row, str + f->path_off);
+			PUT32(FS_CAT_FILE_PATH_LEN, row, f->path_len);
+			PUT32(FS_CAT_FILE_INO, row, f->ino);
+			PUT32(FS_CAT_FILE_MODE, row, f->mode);
+			PUT64(FS_CAT_FILE_SIZE, row, f->size);
+			PUT64(FS_CAT_FILE_HASH, row, f->hash);
+		}
+		str += ci->strings_len;
+	}
+
+	struct fs_out o;
+	if (fs_out_open(&o, out) < 0)
+	{
+		goto out;
+	}
+	if (fs_out_section(&o, &hdr, sizeof(hdr)) < 0)
+	{
+		goto fail;
+	}
+	for (int col = 0; col < FS_CATALOG_COLUMNS; col++)
+	{
+		u64 rows = hdr.columns[col].per_file ? hdr.file_count : hdr.image_count;
+		if (fs_out_section(&o, data[col], rows * column_width[col]) < 0)
+		{
+			goto fail;
+		}
+	}
+	for (size_t i = 0; i < c->count; i++)
+	{
+		const struct catalog_image *ci = &c->images[i];
+		if (fs_out_write(&o, ci->path, strlen(ci->path) + 1) < 0 ||
+			fs_out_write(&o, ci->strings, ci->strings_len) < 0)
+		{
+			goto fail;
+		}
+	}
+	if (fs_out_pad(&o) < 0)
+	{
+		goto fail;
+	}
+	ret = fs_out_commit(&o);
+	goto out;
+
+fail:
+	fs_out_abort(&o);
+out:
+	for (int col = 0; col < FS_CATALOG_COLUMNS; col++)
+	{
+		free(data[col]);
+	}
+	return ret;
+}
+
+int fs_catalog(char *const *images, size_t count, int workers, const char *out, struct fs_catalog_stats *stats)
+{
+	struct catalog c = {0};
+	struct timespec t0, t1;
+	int started = 0, ret = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (workers < 1)
+		workers = 1;
+	if ((size_t)workers > count)
+		workers = count ? count : 1;
+	struct catalog_worker *pool = calloc(workers, sizeof(*pool));
+	if (pool == NULL || (c.images = calloc(count ? count : 1, sizeof(*c.images))) == NULL)
+	{
+		free(pool);
+		return -1;
+	}
+	c.count = count;
+	for (size_t i = 0; i < count; i++)
+	{
+		c.images[i].path = images[i];
+	}
+
+	for (int i = 0; i < workers; i++)
+	{
+		pool[i].c = &c;
+		arena_init(&pool[i].image, 4096);
+		arena_init(&pool[i].scratch, 64 * 1024);
+	}
+	for (; started < workers; started++)
+	{
+		if ((errno = pthread_create(&pool[started].thread, NULL, catalog_worker, &pool[started])) != 0)
+		{
+			if (started == 0)
+				goto out;
+			break;
+		}
+	}
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(pool[i].thread, NULL);
+	}
+	ret = write_catalog(&c, out);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	memset(stats, 0, sizeof(*stats));
+	stats->images = count;
+	for (size_t i = 0; i < count; i++)
+	{
+		stats->failed += c.images[i].status != 0;
+		stats->files += c.images[i].nfiles;
+	}
+	stats->bytes_hashed = atomic_load(&c.bytes_hashed);
+	stats->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+out:
+	{
+		int err = errno;
+		for (int i = 0; i < workers; i++)
+		{
+			arena_free(&pool[i].image);
+			arena_free(&pool[i].scratch);
+			free(pool[i].entries);
+			free(pool[i].strings);
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			free(c.images[i].files);
+			free(c.images[i].strings);
+		}
+		free(c.images);
+		free(pool);
+		errno = err;
+	}
+	return ret;
+}
@@ -0,0 +1,79 @@
+#ifndef FS_CATALOG_H
+#define FS_CATALOG_H
+
+#include "ext2-headers.h"
+
+/*
+	Inventory of many images in one columnar file, host byte order:
+
+		header
+		one section per column, 8 byte aligned; image columns have
+		image_count values, file columns file_count values
+		strings                 image and file paths
+
+	Files are grouped by image (FS_CAT_IMAGE_FILE_FIRST/FILE_COUNT) and
+	sorted by path within an image. An image that could not be read has
+	a non-zero errno in FS_CAT_IMAGE_STATUS and no files.
+*/
+
+#define FS_CATALOG_MAGIC 0x54434532 /* "2ECT" */
+#define FS_CATALOG_VERSION 1
+/* per image in flight: the read planner's staging buffer and the file content buffer */
+#define FS_CATALOG_BUDGET (1024 * 1024)
+
+enum fs_catalog_column
+{
+	FS_CAT_IMAGE_PATH,		  /* u64 string offset */
+	FS_CAT_IMAGE_PATH_LEN,	  /* u32 */
+	FS_CAT_IMAGE_STATUS,	  /* u32, 0 or errno */
+	FS_CAT_IMAGE_BLOCK_SIZE,  /* u32 */
+	FS_CAT_IMAGE_BLOCKS,	  /* u32 */
+	FS_CAT_IMAGE_INODES,	  /* u32 */
+	FS_CAT_IMAGE_FREE_BLOCKS, /* u32 */
+	FS_CAT_IMAGE_FREE_INODES, /* u32 */
+	FS_CAT_IMAGE_GROUPS,	  /* u32 */
+	FS_CAT_IMAGE_FILE_FIRST,  /* u64 row of its first file */
+	FS_CAT_IMAGE_FILE_COUNT,  /* u32 */
+	FS_CAT_FILE_IMAGE,		  /* u32 image row */
+	FS_CAT_FILE_PATH,		  /* u64 string offset */
+	FS_CAT_FILE_PATH_LEN,	  /* u32 */
+	FS_CAT_FILE_INO,		  /* u32 */
+	FS_CAT_FILE_MODE,		  /* u32 */
+	FS_CAT_FILE_SIZE,		  /* u64 */
+	FS_CAT_FILE_HASH,		  /* u64 FNV-1a of the contents, regular files only */
+	FS_CATALOG_COLUMNS
+};
+
+struct fs_catalog_column_desc
+{
+	u64 off;
+	u32 width; /* bytes per value */
+	u32 per_file; /* 0: one value per image, 1: per file */
+};
+
+struct fs_catalog_header
+{
+	u32 magic;
+	u32 version;
+	u32 header_size;
+	u32 column_count;
+	u64 image_count;
+	u64 file_count;
+	u64 strings_off;
+	u64 strings_size;
+	u64 file_size;
+	struct fs_catalog_column_desc columns[FS_CATALOG_COLUMNS];
+};
+
+struct fs_catalog_stats
+{
+	u64 images;
+	u64 failed;
+	u64 files;
+	u64 bytes_hashed;
+	double seconds;
+};
+
+int fs_catalog(char *const *images, size_t count, int workers, const char *out, struct fs_catalog_stats *stats);
+
+#endif /* FS_CATALOG_H */
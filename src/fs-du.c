@@ -0,0 +1,647 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs-arena.h"
+#include "fs-du.h"
+#include "fs-plan.h"
+
+/*
+	du without mounting, in three steps:
+
+	1. every group's inode bitmap and inode table are read with one pread
+	   each (groups spread over the workers) and reduced batch by batch:
+	   the fields we need are gathered into small arrays first so the
+	   arithmetic runs as plain loops the compiler can vectorize;
+	2. the directories found in step 1 are read to learn each inode's
+	   parent (the first link seen wins, like du), their blocks batched
+	   through a read plan so each worker sweeps the image in offset order;
+	3. sizes are summed bottom-up, deepest directories first.
+*/
+
+#define DU_BATCH 256
+#define DU_SIZE_BUCKETS 42 /* 0, then [2^(i-1), 2^i), the last one 1 TiB and up */
+#define DU_AGE_BUCKETS 8
+
+static const char *const age_labels[DU_AGE_BUCKETS] = {
+	"1d", "7d", "30d", "90d", "1y", "2y", "5y", "older"};
+static const u32 age_limits[DU_AGE_BUCKETS - 1] = {
+	86400, 7 * 86400, 30 * 86400, 90 * 86400, 365 * 86400, 2 * 365 * 86400, 5 * 365 * 86400};
+
+struct du_totals
+{
+	u64 inodes, files, dirs, symlinks, other;
+	u64 logical;   /* sum of i_size */
+	u64 allocated; /* sum of i_blocks * 512 */
+	u64 sparse;	   /* regular files with fewer blocks than their size needs */
+	u64 size_hist[DU_SIZE_BUCKETS];
+	u64 age_hist[DU_AGE_BUCKETS];
+};
+
+struct du_dir
+{
+	u32 ino;
+	struct ext2_inode inode;
+};
+
+struct du_worker
+{
+	pthread_t thread;
+	struct du *d;
+	struct du_totals totals;
+	struct du_dir *dirs;
+	size_t ndirs, dirs_cap;
+	struct arena names; /* directory names, kept until the report */
+	struct arena scratch;
+	unsigned char *table;
+	int failed;
+	int err;
+};
+
+struct du
+{
+	const struct fs_image *img;
+	u32 now;
+	atomic_uint next; /* next group (step 1) / directory (step 2) */
+	u64 *own;		  /* allocated bytes per inode, index ino - 1 */
+	u16 *mode;
+	_Atomic u32 *parent;
+	char **name;
+	struct du_dir *dirs; /* all workers' directories, step 2 */
+	size_t ndirs;
+};
+
+static int du_push_dir(struct du_worker *w, u32 ino, const struct ext2_inode *inode)
+{
+	if (array_grow(&w->dirs, &w->dirs_cap, w->ndirs + 1, sizeof(*w->dirs)) < 0)
+	{
+		return -1;
+	}
+	w->dirs[w->ndirs].ino = ino;
+	w->dirs[w->ndirs].inode = *inode;
+	w->ndirs++;
+	return 0;
+}
+
+/* one batch of inodes, fields already split out into arrays */
+static void du_reduce(struct du_totals *t, u32 n, const u32 *used, const u32 *type, const u64 *size,
+					  const u32 *blocks, const u32 *mtime, u32 now, u64 *own)
+{
+	u64 files = 0, dirs = 0, links = 0, count = 0, logical = 0, allocated = 0, sparse = 0;
+	u64 needed[DU_BATCH];
+
+	for (u32 k = 0; k < n; k++)
+	{
+		own[k] = (u64)blocks[k] * 512 * used[k];
+		count += used[k];
+		files += used[k] & (type[k] == EXT2_S_IFREG);
+		dirs += used[k] & (type[k] == EXT2_S_IFDIR);
+		links += used[k] & (type[k] == EXT2_S_IFLNK);
+		logical += size[k] * used[k];
+		allocated += own[k];
+		/* sectors the data alone would need */
+		needed[k] = size[k] / 512 + (size[k] % 512 != 0);
+	}
+	for (u32 k = 0; k < n; k++)
+	{
+		sparse += used[k] & (type[k] == EXT2_S_IFREG) & (blocks[k] < needed[k]);
+	}
+
+	t->inodes += count;
+	t->files += files;
+	t->dirs += dirs;
+	t->symlinks += links;
+	t->other += count - files - dirs - links;
+	t->logical += logical;
+	t->allocated += allocated;
+	t->sparse += sparse;
+
+	for (u32 k = 0; k < n; k++)
+	{
+		if (!used[k] || type[k] != EXT2_S_IFREG)
+			continue;
+		u32 bucket = size[k] ? 64 - __builtin_clzll(size[k]) : 0;
+		t->size_hist[bucket < DU_SIZE_BUCKETS ? bucket : DU_SIZE_BUCKETS - 1]++;
+		u32 age = now > mtime[k] ? now - mtime[k] : 0;
+		u32 b = 0;
+		while (b < DU_AGE_BUCKETS - 1 && age >= age_limits[b])
+			b++;
+		t->age_hist[b]++;
+	}
+}
+
+static int du_scan_group(struct du_worker *w, u32 g, unsigned char *bitmap)
+{
+	const struct fs_image *img = w->d->img;
+	u32 ipg = img->super.s_inodes_per_group;
+	u32 first_ino = img->super.s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_FIRST_INO : img->super.s_first_ino;
+	u32 table_blocks = ((u64)ipg * img->inode_size + img->block_size - 1) / img->block_size;
+
+	if (fs_read_block(img, img->gdt[g].bg_inode_bitmap, bitmap) < 0 ||
+		fs_read_blocks(img, img->gdt[g].bg_inode_table, table_blocks, w->table) < 0)
+	{
+		return -1;
+	}
+
+	u32 used[DU_BATCH], type[DU_BATCH], blocks[DU_BATCH], mtime[DU_BATCH];
+	u64 size[DU_BATCH];
+	for (u32 base = 0; base < ipg; base += DU_BATCH)
+	{
+		u32 n = ipg - base < DU_BATCH ? ipg - base : DU_BATCH;
+		u32 batch_ino = g * ipg + base + 1;
+		if (batch_ino > img->super.s_inodes_count)
+			break;
+		if (n > img->super.s_inodes_count - batch_ino + 1)
+			n = img->super.s_inodes_count - batch_ino + 1;
+
+		/* gather: strided inode records -> one array per field */
+		for (u32 k = 0; k < n; k++)
+		{
+			const struct ext2_inode *inode =
+				(const struct ext2_inode *)(w->table + (size_t)(base + k) * img->inode_size);
+			u32 i = base + k;
+			/* reserved inodes (resize, journal, ...) are not files */
+			used[k] = ((bitmap[i / 8] >> (i % 8)) & 1) && inode->i_mode != 0 && inode->i_links_count != 0 &&
+					  (batch_ino + k == EXT2_ROOT_INO || batch_ino + k >= first_ino);
+			type[k] = inode->i_mode & 0xF000;
+			size[k] = fs_inode_size(inode);
+			blocks[k] = inode->i_blocks;
+			mtime[k] = inode->i_mtime;
+			w->d->mode[batch_ino - 1 + k] = used[k] ? inode->i_mode : 0;
+			if (used[k] && type[k] == EXT2_S_IFDIR && du_push_dir(w, batch_ino + k, inode) < 0)
+				return -1;
+		}
+		du_reduce(&w->totals, n, used, type, size, blocks, mtime, w->d->now, w->d->own + batch_ino - 1);
+	}
+	return 0;
+}
+
+struct du_link_ctx
+{
+	struct du_worker *w;
+	u32 dir;
+};
+
+static int du_link(void *ctx, u32 ino, const char *name, size_t name_len)
+{
+	struct du_link_ctx *l = ctx;
+	struct du *d = l->w->d;
+	if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.') ||
+		ino < 1 || ino > d->img->super.s_inodes_count || ino == EXT2_ROOT_INO)
+	{
+		return 0;
+	}
+
+	u32 none = 0;
+	if (atomic_compare_exchange_strong(&d->parent[ino - 1], &none, l->dir) &&
+		(d->mode[ino - 1] & 0xF000) == EXT2_S_IFDIR)
+	{
+		if ((d->name[ino - 1] = arena_strndup(&l->w->names, name, name_len)) == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+static void *du_worker_main(void *arg)
+{
+	struct du_worker *w = arg;
+	struct du *d = w->d;
+	const struct fs_image *img = d->img;
+	unsigned char *bitmap = arena_alloc(&w->scratch, img->block_size);
+	size_t table = ((u64)img->super.s_inodes_per_group * img->inode_size + img->block_size - 1) /
+				   img->block_size * img->block_size;
+	if (bitmap == NULL || (w->table = malloc(table)) == NULL)
+	{
+		w->failed = 1;
+		w->err = ENOMEM;
+		return NULL;
+	}
+
+	u32 g;
+	while ((g = atomic_fetch_add(&d->next, 1)) < img->groups)
+	{
+		if (du_scan_group(w, g, bitmap) < 0)
+		{
+			w->failed = 1;
+			w->err = errno;
+			break;
+		}
+	}
+	free(w->table);
+	w->table = NULL;
+	return NULL;
+}
+
+struct du_dblock
+{
+	struct du_worker *w;
+	u32 dir;
+	unsigned char buf[];
+};
+
+static int du_link_block(void *ctx, void *buf)
+{
+	struct du_dblock *db = ctx;
+	struct du_link_ctx l = {db->w, db->dir};
+	return fs_dir_block(db->w->d->img, buf, du_link, &l) < 0 ? -1 : 0;
+}
+
+static int du_link_queue(struct du_worker *w, struct fs_plan *plan, struct slab *blocks, const struct du_dir *dir)
+{
+	const struct fs_image *img = w->d->img;
+	u32 nblocks = (dir->inode.i_size + img->block_size - 1) / img->block_size;
+	for (u32 lblock = 0; lblock < nblocks; lblock++)
+	{
+		u32 block;
+		if (fs_block_map(img, &dir->inode, lblock, &block) < 0)
+		{
+			return -1;
+		}
+		if (block == 0)
+		{
+			continue;
+		}
+		struct du_dblock *db = slab_alloc(blocks);
+		if (db == NULL)
+		{
+			return -1;
+		}
+		db->w = w;
+		db->dir = dir->ino;
+		if (fs_plan_block(plan, block, db->buf, du_link_block, db) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *du_link_main(void *arg)
+{
+	struct du_worker *w = arg;
+	struct du *d = w->d;
+	struct fs_plan plan;
+	struct slab blocks;
+	struct arena_mark mark = arena_mark(&w->scratch);
+	int done = 0;
+
+	if (fs_plan_init(&plan, d->img, FS_PLAN_MAX_GAP, FS_PLAN_MAX_READ) < 0)
+	{
+		w->failed = 1;
+		w->err = errno;
+		return NULL;
+	}
+	slab_init(&blocks, &w->scratch, sizeof(struct du_dblock) + d->img->block_size);
+	while (!done)
+	{
+		size_t i = atomic_fetch_add(&d->next, 1);
+		done = i >= d->ndirs;
+		if (!done && du_link_queue(w, &plan, &blocks, &d->dirs[i]) < 0)
+		{
+			goto fail;
+		}
+		/* blocks of several directories per sweep */
+		if (plan.count >= DU_BATCH || (done && plan.count > 0))
+		{
+			if (fs_plan_run(&plan) != 0)
+				goto fail;
+			arena_rewind(&w->scratch, mark);
+			slab_init(&blocks, &w->scratch, sizeof(struct du_dblock) + d->img->block_size);
+		}
+	}
+	fs_plan_free(&plan);
+	return NULL;
+
+fail:
+	w->failed = 1;
+	w->err = errno;
+	plan.count = 0;
+	fs_plan_free(&plan);
+	return NULL;
+}
+
+static int du_run(struct du *d, struct du_worker *pool, int workers, void *(*fn)(void *))
+{
+	int started = 0, failed = 0;
+	atomic_store(&d->next, 0);
+	for (; started < workers; started++)
+	{
+		if ((errno = pthread_create(&pool[started].thread, NULL, fn, &pool[started])) != 0)
+		{
+			if (started == 0)
+				return -1;
+			break;
+		}
+	}
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(pool[i].thread, NULL);
+		if (pool[i].failed && !failed)
+		{
+			failed = 1;
+			errno = pool[i].err;
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+/*
+	Depth below the root, UINT32_MAX when the root cannot be reached. The
+	climb stops at a directory whose depth is known; a chain longer than
+	the inode count can only be a loop in a corrupt image.
+*/
+static u32 du_depth(const struct du *d, u32 ino, u32 *depth)
+{
+	u32 limit = d->img->super.s_inodes_count;
+	u32 steps = 0, at = ino, base;
+	for (;;)
+	{
+		if (at == EXT2_ROOT_INO)
+		{
+			base = 0;
+			break;
+		}
+		if (depth[at - 1])
+		{
+			base = depth[at - 1];
+			break;
+		}
+		u32 parent = atomic_load(&d->parent[at - 1]);
+		if (parent == 0 || steps == limit)
+		{
+			if (parent != 0)
+				fprintf(stderr, "inode %u: directory parent chain loops, image is corrupt\n", ino);
+			base = UINT32_MAX;
+			steps++; /* at itself is unreachable too */
+			break;
+		}
+		at = parent;
+		steps++;
+	}
+
+	/* fill in the chain from ino up, each one level above the last */
+	u32 ret = base == UINT32_MAX ? base : base + steps;
+	for (u32 i = 0, cur = ino; i < steps; i++)
+	{
+		depth[cur - 1] = base == UINT32_MAX ? base : base + steps - i;
+		cur = atomic_load(&d->parent[cur - 1]);
+	}
+	return ret;
+}
+
+static void json_string(FILE *out, const char *s, size_t len)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+/* path of a directory from the parent chain, written right to left */
+static size_t du_path(const struct du *d, u32 ino, char *buf, size_t cap)
+{
+	size_t pos = cap;
+	while (ino != EXT2_ROOT_INO && ino != 0)
+	{
+		const char *name = d->name[ino - 1];
+		size_t n = name ? strlen(name) : 1;
+		if (pos < n + 1)
+			break;
+		pos -= n;
+		memcpy(buf + pos, name ? name : "?", n);
+		buf[--pos] = '/';
+		ino = atomic_load(&d->parent[ino - 1]);
+	}
+	if (pos == cap)
+		buf[--pos] = '/';
+	memmove(buf, buf + pos, cap - pos);
+	return cap - pos;
+}
+
+struct du_rank
+{
+	u32 ino;
+	u64 bytes;
+	u64 inodes;
+};
+
+static int du_rank_cmp(const void *a, const void *b)
+{
+	const struct du_rank *x = a, *y = b;
+	if (x->bytes != y->bytes)
+		return x->bytes < y->bytes ? 1 : -1;
+	return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static int du_depth_cmp(const void *a, const void *b)
+{
+	const u64 *x = a, *y = b; /* depth << 32 | ino, deepest first */
+	return (*x < *y) - (*x > *y);
+}
+
+static void du_report(const struct du *d, const struct du_totals *t, const u64 *cum, const u64 *cnt,
+					  struct du_rank *rank, size_t nrank, int top, double elapsed, FILE *out)
+{
+	fprintf(out, "{\n  \"image\": ");
+	json_string(out, d->img->path, strlen(d->img->path));
+	fprintf(out,
+			",\n  \"groups\": %u,\n  \"seconds\": %.6f,\n"
+			"  \"inodes\": %llu,\n  \"files\": %llu,\n  \"dirs\": %llu,\n"
+			"  \"symlinks\": %llu,\n  \"other\": %llu,\n"
+			"  \"logical_bytes\": %llu,\n  \"allocated_bytes\": %llu,\n"
+			"  \"sparse_files\": %llu,\n  \"allocated_to_logical\": %.6f,\n",
+			d->img->groups, elapsed,
+			(unsigned long long)t->inodes, (unsigned long long)t->files, (unsigned long long)t->dirs,
+			(unsigned long long)t->symlinks, (unsigned long long)t->other,
+			(unsigned long long)t->logical, (unsigned long long)t->allocated,
+			(unsigned long long)t->sparse, t->logical ? (double)t->allocated / t->logical : 0.0);
+
+	int last = 0;
+	for (int i = 0; i < DU_SIZE_BUCKETS; i++)
+		if (t->size_hist[i])
+			last = i;
+	fprintf(out, "  \"size_histogram\": [");
+	for (int i = 0; i <= last; i++)
+	{
+		if (i == DU_SIZE_BUCKETS - 1)
+			fprintf(out, "%s\n    {\"at_least\": %llu, \"files\": %llu}", i ? "," : "",
+					(unsigned long long)((u64)1 << (i - 1)), (unsigned long long)t->size_hist[i]);
+		else
+			fprintf(out, "%s\n    {\"below\": %llu, \"files\": %llu}", i ? "," : "",
+					(unsigned long long)(i ? (u64)1 << i : 1), (unsigned long long)t->size_hist[i]);
+	}
+	fprintf(out, "\n  ],\n  \"age_histogram\": [");
+	for (int i = 0; i < DU_AGE_BUCKETS; i++)
+	{
+		fprintf(out, "%s\n    {\"within\": \"%s\", \"files\": %llu}", i ? "," : "", age_labels[i],
+				(unsigned long long)t->age_hist[i]);
+	}
+	fprintf(out, "\n  ],\n  \"directories\": [");
+
+	char path[FS_PATH_MAX];
+	size_t shown = top > 0 && (size_t)top < nrank ? (size_t)top : nrank;
+	for (size_t i = 0; i < shown; i++)
+	{
+		size_t n = du_path(d, rank[i].ino, path, sizeof(path));
+		fprintf(out, "%s\n    {\"path\": ", i ? "," : "");
+		json_string(out, path, n);
+		fprintf(out, ", \"inode\": %u, \"bytes\": %llu, \"inodes\": %llu}", rank[i].ino,
+				(unsigned long long)cum[rank[i].ino - 1], (unsigned long long)cnt[rank[i].ino - 1]);
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+int fs_du(const struct fs_image *img, int workers, int top, FILE *out)
+{
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	size_t n = img->super.s_inodes_count;
+	struct du d = {0};
+	d.img = img;
+	d.now = time(NULL);
+	d.own = calloc(n, sizeof(*d.own));
+	d.mode = calloc(n, sizeof(*d.mode));
+	d.parent = calloc(n, sizeof(*d.parent));
+	d.name = calloc(n, sizeof(*d.name));
+	if (workers < 1)
+		workers = 1;
+	struct du_worker *pool = calloc(workers, sizeof(*pool));
+	u64 *cum = NULL, *cnt = NULL, *order = NULL;
+	u32 *depth = NULL;
+	struct du_rank *rank = NULL;
+	int ret = -1;
+
+	if (!d.own || !d.mode || !d.parent || !d.name || !pool)
+		goto out;
+	for (int i = 0; i < workers; i++)
+	{
+		pool[i].d = &d;
+		arena_init(&pool[i].names, ARENA_DEFAULT_CHUNK);
+		arena_init(&pool[i].scratch, 4 * img->block_size);
+	}
+
+	/* 1: inode tables */
+	if (du_run(&d, pool, workers, du_worker_main) < 0)
+		goto out;
+
+	/* 2: directory blocks */
+	for (int i = 0; i < workers; i++)
+		d.ndirs += pool[i].ndirs;
+	if ((d.dirs = malloc((d.ndirs ? d.ndirs : 1) * sizeof(*d.dirs))) == NULL)
+		goto out;
+	d.ndirs = 0;
+	for (int i = 0; i < workers; i++)
+	{
+		memcpy(d.dirs + d.ndirs, pool[i].dirs, pool[i].ndirs * sizeof(*d.dirs));
+		d.ndirs += pool[i].ndirs;
+	}
+	if (du_run(&d, pool, workers, du_link_main) < 0)
+		goto out;
+
+	/* 3: files into their directory, then directories deepest first */
+	struct du_totals totals = {0};
+	for (int i = 0; i < workers; i++)
+	{
+		const struct du_totals *t = &pool[i].totals;
+		totals.inodes += t->inodes;
+		totals.files += t->files;
+		totals.dirs += t->dirs;
+		totals.symlinks += t->symlinks;
+		totals.other += t->other;
+		totals.logical += t->logical;
+		totals.allocated += t->allocated;
+		totals.sparse += t->sparse;
+		for (int b = 0; b < DU_SIZE_BUCKETS; b++)
+			totals.size_hist[b] += t->size_hist[b];
+		for (int b = 0; b < DU_AGE_BUCKETS; b++)
+			totals.age_hist[b] += t->age_hist[b];
+	}
+
+	cum = malloc(n * sizeof(*cum));
+	cnt = malloc(n * sizeof(*cnt));
+	depth = calloc(n, sizeof(*depth));
+	order = malloc((d.ndirs ? d.ndirs : 1) * sizeof(*order));
+	rank = malloc((d.ndirs ? d.ndirs : 1) * sizeof(*rank));
+	if (!cum || !cnt || !depth || !order || !rank)
+		goto out;
+	for (size_t i = 0; i < n; i++)
+	{
+		cum[i] = d.own[i];
+		cnt[i] = d.mode[i] != 0;
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		u32 parent = atomic_load(&d.parent[i]);
+		if (d.mode[i] && (d.mode[i] & 0xF000) != EXT2_S_IFDIR && parent)
+		{
+			cum[parent - 1] += cum[i];
+			cnt[parent - 1] += cnt[i];
+		}
+	}
+	size_t ndirs = 0;
+	for (size_t i = 0; i < d.ndirs; i++)
+	{
+		u32 dd = du_depth(&d, d.dirs[i].ino, depth);
+		if (dd != UINT32_MAX)
+			order[ndirs++] = (u64)dd << 32 | d.dirs[i].ino;
+	}
+	qsort(order, ndirs, sizeof(*order), du_depth_cmp);
+	for (size_t i = 0; i < ndirs; i++)
+	{
+		u32 ino = (u32)order[i];
+		u32 parent = ino == EXT2_ROOT_INO ? 0 : atomic_load(&d.parent[ino - 1]);
+		if (parent)
+		{
+			cum[parent - 1] += cum[ino - 1];
+			cnt[parent - 1] += cnt[ino - 1];
+		}
+		rank[i].ino = ino;
+	}
+	for (size_t i = 0; i < ndirs; i++)
+	{
+		rank[i].bytes = cum[rank[i].ino - 1];
+		rank[i].inodes = cnt[rank[i].ino - 1];
+	}
+	qsort(rank, ndirs, sizeof(*rank), du_rank_cmp);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	du_report(&d, &totals, cum, cnt, rank, ndirs, top,
+			  (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, out);
+	ret = 0;
+
+out:;
+	int err = errno;
+	if (pool)
+	{
+		for (int i = 0; i < workers; i++)
+		{
+			free(pool[i].dirs);
+			arena_free(&pool[i].names);
+			arena_free(&pool[i].scratch);
+		}
+	}
+	free(pool);
+	free(d.own);
+	free(d.mode);
+	free(d.parent);
+	free(d.name);
+	free(d.dirs);
+	free(cum);
+	free(cnt);
+	free(depth);
+	free(order);
+	free(rank);
+	errno = err;
+	return ret;
+}
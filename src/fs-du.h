@@ -0,0 +1,10 @@
+#ifndef FS_DU_H
+#define FS_DU_H
+
+#include <stdio.h>
+#include "fs-image.h"
+
+/* space usage of the whole image as JSON; top = directories listed (0: all) */
+int fs_du(const struct fs_image *img, int workers, int top, FILE *out);
+
+#endif /* FS_DU_H */
@@ -5,298 +5,633 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
-#include "ext2-headers.h"
-#include <math.h>
 #include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include "ext2-headers.h"
+#include "fs-arena.h"
+#include "fs-catalog.h"
+#include "fs-image.h"
+#include "fs-index.h"
+#include "fs-du.h"
+#include "fs-plan.h"
+#include "fs-serve.h"
 /* locates beginning of the super block (first group) */
 #define FD_DEVICE "ext2_filesystem_reference.img" /* the floppy disk device */
-#define EXT2_SUPER_MAGIC 0xEF53
-#define SUPERBLOCK_OFFSET 1024
-#define FIND_BLOCK_OFFSET(i) (block_size * i)
 
-static unsigned int block_size = 0; /* block size (to be calculated) */
+/*
+	Two arenas per run: `scratch` is used stack-like (mark/rewind) for block
+	buffers and path strings, `nodes` backs the inode slab. Both are reset
+	between operations, so after the first few chunks a run makes no more
+	heap calls no matter how many entries it visits.
+*/
+struct explorer
+{
+	struct fs_image img;
+	struct fs_index idx; /* -x: answer from the sidecar instead */
+	int use_index;
+	int data_fd; /* image fd for reading file data in -x mode */
+	struct arena image_arena; /* lives as long as the image */
+	struct arena scratch;
+	struct arena nodes;
+	struct slab inodes;
+	struct fs_plan *plan; /* -p: walks read through the planner */
+};
+
+static void explorer_reset(struct explorer *e)
+{
+	arena_reset(&e->scratch);
+	arena_reset(&e->nodes);
+	slab_init(&e->inodes, &e->nodes, sizeof(struct ext2_inode));
+}
 
-int main(void)
+static void print_superblock(const struct fs_image *img)
 {
+	const struct ext2_superblock *super = &img->super;
+	printf("Reading super-block from device %s:\n"
+		   "Inodes count            : %u\n"
+		   "Blocks count            : %u\n"
+		   "Reserved blocks count   : %u\n"
+		   "Free blocks count       : %u\n"
+		   "Free inodes count       : %u\n"
+		   "First data block        : %u\n"
+		   "Block size              : %u\n"
+		   "Blocks per group        : %u\n"
+		   "Inodes per group        : %u\n"
+		   "Creator OS              : %u\n"
+		   "First non-reserved inode: %u\n"
+		   "Size of inode structure : %u\n"
+		   "Revision number : %u\n\n\n",
+		   img->path,
+		   super->s_inodes_count,
+		   super->s_blocks_count,
+		   super->s_r_blocks_count, /* reserved blocks count */
+		   super->s_free_blocks_count,
+		   super->s_free_inodes_count,
+		   super->s_first_data_block,
+		   img->block_size,
+		   super->s_blocks_per_group,
+		   super->s_inodes_per_group,
+		   super->s_creator_os,
+		   super->s_first_ino,
+		   img->inode_size,
+		   super->s_rev_level);
+
+	for (u32 i = 0; i < img->groups; i++)
+	{
+		printf("group : %u\n"
+			   "Block Bitmap           : %u\n"
+			   "Inode Bitmap           : %u\n"
+			   "Inode Table            : %u\n"
+			   "Free Blocks            : %u\n"
+			   "Free Inodes            : %u\n"
+			   "Used Dirs              : %u\n",
+			   i,
+			   img->gdt[i].bg_block_bitmap,
+			   img->gdt[i].bg_inode_bitmap,
+			   img->gdt[i].bg_inode_table,
+			   img->gdt[i].bg_free_blocks_count,
+			   img->gdt[i].bg_free_inodes_count,
+			   img->gdt[i].bg_used_dirs_count);
+	}
+}
 
-	struct ext2_superblock super;
+static void print_inode(u32 ino, const struct ext2_inode *inode)
+{
+	printf("inode          : %u\n"
+		   "imode          : %x\n"
+		   "uid            : %u\n"
+		   "size           : %llu\n"
+		   "gid            : %u\n"
+		   "link count     : %u\n"
+		   "blocks         : %u\n"
+		   "flags          : %u\n"
+		   "block 0        : %u\n"
+		   "block 1        : %u\n",
+		   ino,
+		   inode->i_mode,
+		   inode->i_uid,
+		   (unsigned long long)fs_inode_size(inode),
+		   inode->i_gid,
+		   inode->i_links_count,
+		   inode->i_blocks,
+		   inode->i_flags,
+		   inode->i_block[0],
+		   inode->i_block[1]);
+}
+
+/* bit i of the bitmap block is item first + i */
+static void print_bitmap(const struct fs_image *img, const unsigned char *bitmap, u32 count, u32 first,
+						 const char *what)
+{
+	for (u32 i = fs_bitmap_next(img, bitmap, count, 0); i < count; i = fs_bitmap_next(img, bitmap, count, i + 1))
+	{
+		printf("%s present : %u\n", what, first + i);
+	}
+	printf("%ss in use : %u of %u\n", what, fs_bitmap_count(img, bitmap, count), count);
+}
 
-	int fd;
+static int cmd_info(struct explorer *e)
+{
+	const struct fs_image *img = &e->img;
+	print_superblock(img);
 
-	/* open device */
+	unsigned char *bitmap = arena_alloc(&e->scratch, img->block_size);
+	if (bitmap == NULL)
+	{
+		return -1;
+	}
+	for (u32 g = 0; g < img->groups; g++)
+	{
+		u32 first_block = img->super.s_first_data_block + g * img->super.s_blocks_per_group;
+		u32 nblocks = img->super.s_blocks_count - first_block;
+		if (nblocks > img->super.s_blocks_per_group)
+			nblocks = img->super.s_blocks_per_group;
+
+		if (fs_read_block(img, img->gdt[g].bg_block_bitmap, bitmap) < 0)
+			return -1;
+		print_bitmap(img, bitmap, nblocks, first_block, "block");
+
+		if (fs_read_block(img, img->gdt[g].bg_inode_bitmap, bitmap) < 0)
+			return -1;
+		print_bitmap(img, bitmap, img->super.s_inodes_per_group, g * img->super.s_inodes_per_group + 1,
+					 "inode");
+	}
 
-	if ((fd = open(FD_DEVICE, O_RDONLY)) < 0)
+	/* print root inode thingies*/
+	struct ext2_inode *root = slab_alloc(&e->inodes);
+	if (root == NULL || fs_read_inode(img, EXT2_ROOT_INO, root) < 0)
 	{
-		perror(FD_DEVICE);
-		exit(1); /* error while opening the floppy device */
+		return -1;
 	}
+	print_inode(EXT2_ROOT_INO, root);
+	return 0;
+}
 
-	/* read super-block */
+static int cmd_stat(struct explorer *e, const char *path)
+{
+	u32 ino;
+	struct ext2_inode *inode = slab_alloc(&e->inodes);
+	if (inode == NULL || fs_lookup(&e->img, path, &e->scratch, &ino) < 0 ||
+		fs_read_inode(&e->img, ino, inode) < 0)
+	{
+		return -1;
+	}
+	print_inode(ino, inode);
+	return 0;
+}
 
-	lseek(fd, SUPERBLOCK_OFFSET, SEEK_SET);
-	read(fd, &super, sizeof(super));
+static int cmd_cat(struct explorer *e, const char *path)
+{
+	u32 ino;
+	struct ext2_inode *inode = slab_alloc(&e->inodes);
+	if (inode == NULL || fs_lookup(&e->img, path, &e->scratch, &ino) < 0 ||
+		fs_read_inode(&e->img, ino, inode) < 0)
+	{
+		return -1;
+	}
+	if (fs_is_dir(inode))
+	{
+		errno = EISDIR;
+		return -1;
+	}
 
-	if (super.s_magic != EXT2_SUPER_MAGIC)
+	char *buffer = arena_alloc(&e->scratch, e->img.block_size);
+	if (buffer == NULL)
 	{
-		fprintf(stderr, "Not a Ext2 filesystem\n");
-		exit(1);
+		return -1;
 	}
+	for (u64 off = 0, size = fs_inode_size(inode); off < size;)
+	{
+		ssize_t n = fs_read(&e->img, inode, off, buffer, e->img.block_size);
+		if (n <= 0)
+		{
+			return -1;
+		}
+		fwrite(buffer, 1, n, stdout);
+		off += n;
+	}
+	return 0;
+}
 
-	block_size = 1024 << super.s_log_block_size;
+struct walk_stats
+{
+	u64 entries;
+};
 
-	printf("Reading super-block from device " FD_DEVICE ":\n"
-		   "Inodes count            : %u\n"
-		   "Blocks count            : %u\n"
-		   "Reserved blocks count   : %u\n"
-		   "Free blocks count       : %u\n"
-		   "Free inodes count       : %u\n"
-		   "First data block        : %u\n"
-		   "Block size              : %u\n"
-		   "Blocks per group        : %u\n"
-		   "Inodes per group        : %u\n"
-		   "Creator OS              : %u\n"
-		   "First non-reserved inode: %hu\n"
-		   "Size of inode structure : %hu\n"
-		   "Revision number : %hu\n\n\n",
-		   super.s_inodes_count,
-		   super.s_blocks_count,
-		   super.s_r_blocks_count, /* reserved blocks count */
-		   super.s_free_blocks_count,
-		   super.s_free_inodes_count,
-		   super.s_first_data_block,
-		   block_size,
-		   super.s_blocks_per_group,
-		   super.s_inodes_per_group,
-		   super.s_creator_os,
-		   super.s_first_ino,
-		   super.s_inode_size,
-		   super.s_rev_level);
-
-	/*
-		We dont take the reserved GDT entries into account at least now :)
-	*/
-	size_t groups = ceil((double)super.s_blocks_count / (double)super.s_blocks_per_group);
-
-	struct ext2_block_group_descriptor group_descriptor_table[groups + 1];
-	for (size_t i = 0; i < groups; i++)
-	{
-		// printf("group : %d\n", i);
-		lseek(fd, block_size * (i + 1), SEEK_SET);
-		read(fd, &group_descriptor_table[i], sizeof(group_descriptor_table[i]));
-
-		printf("size of %lu\n", sizeof(group_descriptor_table[i]));
-
-		printf(
-			"Block Bitmap           : %hu\n"
-			"Inode Bitmap           : %hu\n"
-			"Inode Table            : %hu\n"
-			"Free Blocks            : %u\n"
-			"Free Inodes            : %u\n"
-			"Used Dirs              : %u\n",
-			group_descriptor_table[i].bg_block_bitmap,
-			group_descriptor_table[i].bg_inode_bitmap,
-			group_descriptor_table[i].bg_inode_table,
-			group_descriptor_table[i].bg_free_blocks_count,
-			group_descriptor_table[i].bg_free_inodes_count,
-			group_descriptor_table[i].bg_used_dirs_count);
-	}
-
-	int *block_bitmap = malloc(sizeof(int));
-	lseek(fd, FIND_BLOCK_OFFSET(group_descriptor_table[0].bg_block_bitmap), SEEK_SET);
-
-	printf("find %d\n", super.s_blocks_count / (32));
-	for (u32 i = 0; i < super.s_blocks_count / (sizeof(int) * 8); i++)
-	{
-
-		read(fd, block_bitmap, sizeof(int));
-		for (char j = 0; j < 32; j++)
+static int print_entry(void *ctx, const char *path, size_t path_len, u32 ino,
+					   const struct ext2_inode *inode)
+{
+	struct walk_stats *s = ctx;
+	(void)path_len;
+	s->entries++;
+	printf("%7u %s%s\n", ino, path, fs_is_dir(inode) ? "/" : "");
+	return 0;
+}
+
+static int cmd_walk(struct explorer *e, const char *path, int list_only)
+{
+	struct walk_stats s = {0};
+	int max_depth = list_only ? 1 : -1;
+	if (e->plan)
+	{
+		u64 requests = e->plan->requests, reads = e->plan->reads;
+		if (fs_walk_planned(&e->img, path, max_depth, &e->scratch, e->plan, print_entry, &s) < 0)
+		{
+			return -1;
+		}
+		if (!list_only)
 		{
-			if ((*block_bitmap) & (1 << j))
-				printf("block present : %u\n", i * 32 + j);
+			fprintf(stderr, "%s: %llu entries, %llu reads merged into %llu\n", path,
+					(unsigned long long)s.entries, (unsigned long long)(e->plan->requests - requests),
+					(unsigned long long)(e->plan->reads - reads));
 		}
+		return 0;
 	}
 
-	int *inode_bitmap = malloc(sizeof(int));
-	lseek(fd, FIND_BLOCK_OFFSET(group_descriptor_table[0].bg_inode_bitmap), SEEK_SET);
+	if (fs_walk(&e->img, path, max_depth, &e->scratch, &e->inodes, print_entry, &s) < 0)
+	{
+		return -1;
+	}
+	if (!list_only)
+	{
+		fprintf(stderr, "%s: %llu entries\n", path, (unsigned long long)s.entries);
+	}
+	return 0;
+}
 
-	// printf("find %d\n", super.s_inodes_per_group/(32));
-	for (u32 i = 0; i < super.s_inodes_per_group / (sizeof(int) * 8); i++)
+static int cmd_index(struct explorer *e, const char *out)
+{
+	if (fs_index_build(&e->img, &e->scratch, out) < 0)
+	{
+		return -1;
+	}
+	fprintf(stderr, "%s: indexed %s\n", out, e->img.path);
+	return 0;
+}
+
+/* -x: same output as above, straight from the mmap()ed sidecar */
+
+static int idx_stat(struct explorer *e, const char *path)
+{
+	const struct fs_index_inode *inode = fs_index_lookup(&e->idx, path);
+	if (inode == NULL)
 	{
+		return -1;
+	}
+	printf("inode          : %u\n"
+		   "imode          : %x\n"
+		   "uid            : %u\n"
+		   "size           : %llu\n"
+		   "gid            : %u\n"
+		   "link count     : %u\n"
+		   "blocks         : %u\n"
+		   "flags          : %u\n"
+		   "extents        : %u\n",
+		   inode->ino,
+		   inode->mode,
+		   inode->uid,
+		   (unsigned long long)inode->size,
+		   inode->gid,
+		   inode->links_count,
+		   inode->blocks,
+		   inode->flags,
+		   inode->extent_count);
+	return 0;
+}
+
+static int idx_cat(struct explorer *e, const char *path)
+{
+	const struct fs_index_inode *inode = fs_index_lookup(&e->idx, path);
+	if (inode == NULL)
+	{
+		return -1;
+	}
+	if ((inode->mode & 0xF000) == EXT2_S_IFDIR)
+	{
+		errno = EISDIR;
+		return -1;
+	}
 
-		read(fd, inode_bitmap, sizeof(int));
-		for (char j = 0; j < 32; j++)
+	size_t chunk = 64 * 1024;
+	char *buffer = arena_alloc(&e->scratch, chunk);
+	if (buffer == NULL)
+	{
+		return -1;
+	}
+	for (u64 off = 0; off < inode->size;)
+	{
+		ssize_t n = fs_index_read(&e->idx, e->data_fd, inode, off, buffer, chunk);
+		if (n <= 0)
 		{
-			// Inefficient AF
-			if ((*inode_bitmap) & (1 << j)) /* Inodes start at 1 lol :D */
-				printf("inode present : %u\n", i * 32 + j + 1);
+			return -1;
 		}
+		fwrite(buffer, 1, n, stdout);
+		off += n;
 	}
+	return 0;
+}
 
-	struct ext2_inode inode_table[super.s_inodes_per_group];
+static int idx_walk(struct explorer *e, const char *path, int list_only)
+{
+	u32 first, last;
+	if (fs_index_lookup(&e->idx, path) == NULL || fs_index_children(&e->idx, path, &first, &last) < 0)
+	{
+		return -1;
+	}
 
-	lseek(fd, FIND_BLOCK_OFFSET((group_descriptor_table[0].bg_inode_table)), SEEK_SET);
-	for (size_t i = 0; i < super.s_first_ino + 1; i++)
+	/* descendants of path sit in one sorted run; ls keeps the direct ones */
+	size_t base = first < last ? strrchr(fs_index_path_name(&e->idx, &e->idx.paths[first]), '/') -
+									 fs_index_path_name(&e->idx, &e->idx.paths[first])
+							   : 0;
+	for (u32 i = first; i < last; i++)
+	{
+		const struct fs_index_path *p = &e->idx.paths[i];
+		const char *name = fs_index_path_name(&e->idx, p);
+		if (list_only && memchr(name + base + 1, '/', p->name_len - base - 1))
+		{
+			continue;
+		}
+		const struct fs_index_inode *inode = fs_index_inode(&e->idx, p->ino);
+		printf("%7u %.*s%s\n", p->ino, (int)p->name_len, name,
+			   inode && (inode->mode & 0xF000) == EXT2_S_IFDIR ? "/" : "");
+	}
+	if (!list_only)
 	{
-		read(fd, &inode_table[i], super.s_inode_size);
+		fprintf(stderr, "%s: %u entries\n", path, last - first);
 	}
+	return 0;
+}
 
-	/* print root inode thingies*/
-	printf(
-		"imode          		: %x\n"
-		"uid           : %u\n"
-		"size            : %hu\n"
-		"gid            : %u\n"
-		"link count           : %u\n"
-		"blocks             : %hu\n"
-		"flags             : %hu\n"
-		"address             : %hu\n",
-		inode_table[EXT2_ROOT_INO - 1].i_mode,
-		inode_table[EXT2_ROOT_INO - 1].i_uid,
-		inode_table[EXT2_ROOT_INO - 1].i_size,
-		inode_table[EXT2_ROOT_INO - 1].i_gid,
-		inode_table[EXT2_ROOT_INO - 1].i_links_count,
-		inode_table[EXT2_ROOT_INO - 1].i_blocks,
-		inode_table[EXT2_ROOT_INO - 1].i_flags,
-		inode_table[EXT2_ROOT_INO - 1].i_faddr);
-	struct ext2_dir_entry root[20];
-	for (size_t i = 0; i < 15; i++)
-	{
-		printf("block ---> %d\n", inode_table[EXT2_ROOT_INO - 1].i_block[i]);
-		if (inode_table[EXT2_ROOT_INO - 1].i_block[i] != 0)
+static void push_image(char ***list, size_t *n, size_t *cap, const char *path)
+{
+	if (array_grow(list, cap, *n + 1, sizeof(**list)) < 0)
+		errno_exit("catalog");
+	if (((*list)[(*n)++] = strdup(path)) == NULL)
+		errno_exit("catalog");
+}
+
+/* images to catalog: plain paths, glob patterns, or @file with one path per line */
+static void cmd_catalog(const char *out, char **args, int nargs, int workers)
+{
+	char **list = NULL;
+	size_t n = 0, cap = 0;
+
+	for (int i = 0; i < nargs; i++)
+	{
+		if (args[i][0] == '@')
 		{
-			if (inode_table[EXT2_ROOT_INO - 1].i_mode & EXT2_S_IFDIR)
+			FILE *f = fopen(args[i] + 1, "r");
+			char line[FS_PATH_MAX];
+			if (f == NULL)
+				errno_exit(args[i] + 1);
+			while (fgets(line, sizeof(line), f))
 			{
-				lseek(fd, FIND_BLOCK_OFFSET(inode_table[EXT2_ROOT_INO - 1].i_block[i]), SEEK_SET);
-				int j = 0;
-				do
-				{
-					read(fd, &root[j], 8);
-
-					read(fd, &root[j].name, root[j].rec_len - 8);
-					j++;
-				} while (root[j - 1].rec_len > 0 && (lseek(fd, 0, SEEK_CUR) + root[j - 1].rec_len < FIND_BLOCK_OFFSET(inode_table[EXT2_ROOT_INO - 1].i_block[i]) + block_size));
+				line[strcspn(line, "\r\n")] = '\0';
+				if (line[0] != '\0')
+					push_image(&list, &n, &cap, line);
 			}
+			fclose(f);
+		}
+		else if (strpbrk(args[i], "*?["))
+		{
+			glob_t g;
+			int ret = glob(args[i], 0, NULL, &g);
+			if (ret == GLOB_NOMATCH)
+			{
+				fprintf(stderr, "%s: no match\n", args[i]);
+				continue;
+			}
+			if (ret != 0)
+				errno_exit(args[i]);
+			for (size_t k = 0; k < g.gl_pathc; k++)
+				push_image(&list, &n, &cap, g.gl_pathv[k]);
+			globfree(&g);
+		}
+		else
+		{
+			push_image(&list, &n, &cap, args[i]);
 		}
 	}
 
-	// int i = 0;
-	// while (1)
-	// {
-	// 	printf(
-	// 		"inode          		: %d\n"
-	// 		"name          		: %s\n",
-	// 		root[i].inode,
-	// 		root[i].name);
-	// 	if (root[i].rec_len <= 0)
-	// 		break;
-	// 	i++;
-	// }
-
-	char *get_dir[] = {"hoolp", "hi", "hello.txt"};
-	int len = sizeof(get_dir) / sizeof(char *);
-	int father_node = 2;
-	int inode_size = super.s_inode_size;
-	for (size_t i = 0; i < len; i++)
-	{
-		int wrong_input = 0;
-		// printf("inode table at : %x -\n",FIND_BLOCK_OFFSET(group_descriptor_table[0].bg_inode_table) + (father_node - 1) * inode_size);
-		lseek(fd, FIND_BLOCK_OFFSET(group_descriptor_table[0].bg_inode_table) + (father_node - 1) * inode_size, SEEK_SET);
-		struct ext2_inode this_inode;
-		read(fd, &this_inode, inode_size);
-		// printf("super size : %d\n",super.s_inode_size);
-		printf("\n\n"
-			   "imode          		: %x\n"
-			   "uid           : %u\n"
-			   "size            : %hu\n"
-			   "gid            : %u\n"
-			   "link count           : %u\n"
-			   "blocks             : %hu\n"
-			   "flags             : %hu\n"
-			   "block 0             : %hu\n"
-			   "block 1             : %hu\n"
-			   "address             : %hu\n",
-			   this_inode.i_mode,
-			   this_inode.i_uid,
-			   this_inode.i_size,
-			   this_inode.i_gid,
-			   this_inode.i_links_count,
-			   this_inode.i_blocks,
-			   this_inode.i_flags,
-			   this_inode.i_block[0],
-			   this_inode.i_block[1],
-			   this_inode.i_faddr);
-		// printf("superrrrrrrrrrrrrr size : %d\n",super.s_inode_size);
-
-		if (this_inode.i_mode & EXT2_S_IFDIR)
+	struct fs_catalog_stats st;
+	if (fs_catalog(list, n, workers, out, &st) < 0)
+		errno_exit(out);
+	fprintf(stderr, "%llu images (%llu unreadable), %llu files, %.1f MiB hashed in %.3f s: %.1f images/sec\n",
+			(unsigned long long)st.images, (unsigned long long)st.failed, (unsigned long long)st.files,
+			st.bytes_hashed / 1048576.0, st.seconds, st.seconds > 0 ? st.images / st.seconds : 0.0);
+	for (size_t i = 0; i < n; i++)
+		free(list[i]);
+	free(list);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+			"usage: %s [-i image] [-x index] [-j workers] [-m] [-G] [-p] [command [args...]]\n"
+			"  info             superblock, group descriptors, bitmaps, root inode (default)\n"
+			"  stat <path>...   inode of each path\n"
+			"  cat <path>...    contents of each path\n"
+			"  ls <path>...     entries of each directory\n"
+			"  walk [path]...   every entry below each directory\n"
+			"  index <file>     write a metadata sidecar for the image\n"
+			"  du [top]         space usage as JSON, top directories (default 20, 0: all)\n"
+			"  serve <socket> [image]...\n"
+			"                   answer fs-proto requests on a unix socket\n"
+			"  catalog <out> <image|glob|@list>...\n"
+			"                   geometry, files and content hashes of many images\n"
+			"  -x index         answer stat/cat/ls/walk from a sidecar\n"
+			"  -j workers       threads for serve, du and catalog (default: online cpus)\n"
+			"  -m               report arena memory use on exit\n"
+			"  -G               generic code paths instead of the block-size specialized ones\n"
+			"  -p               walk/ls breadth first, reads sorted and merged by disk offset\n",
+			prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct explorer e = {0};
+	const char *device = FD_DEVICE;
+	const char *index = NULL;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int report = 0;
+	int generic = 0;
+	int planned = 0;
+	struct fs_plan plan;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:x:j:mGp")) != -1)
+	{
+		switch (opt)
 		{
+		case 'i':
+			device = optarg;
+			break;
+		case 'x':
+			index = optarg;
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		case 'm':
+			report = 1;
+			break;
+		case 'G':
+			generic = 1;
+			break;
+		case 'p':
+			planned = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	const char *cmd = optind < argc ? argv[optind++] : "info";
+	char *root_only[] = {"/"};
+	char **paths = argv + optind;
+	int npaths = argc - optind;
 
-			for (size_t block = 0; block < 15; block++)
-			{
+	if (!strcmp(cmd, "serve"))
+	{
+		if (npaths < 1)
+			usage(argv[0]);
+		if (fs_serve(paths[0], workers, paths + 1, npaths - 1) < 0)
+			errno_exit(paths[0]);
+		exit(0);
+	}
+	if (!strcmp(cmd, "catalog"))
+	{
+		if (npaths < 2)
+			usage(argv[0]);
+		cmd_catalog(paths[0], paths + 1, npaths - 1, workers);
+		exit(0);
+	}
 
-				int found = 0;
-				if (this_inode.i_block[block] != 0)
-				{
-					// printf("inode block : %d\n", this_inode.i_block[block]);
-					lseek(fd, FIND_BLOCK_OFFSET(this_inode.i_block[block]), SEEK_SET);
-					int j = 0;
-					struct ext2_dir_entry entry;
-					int sss = 0;
-					do
-					{
-						read(fd, &entry, 8);
-
-						read(fd, &entry.name, entry.rec_len - 8);
-						// printf("supaaaa size : %d\n",super.s_inode_size);
-						if (entry.inode < 1)
-							break;
-						// printf(" yoooooo ------> %s ===== %s --- %d\n", entry.name, get_dir[i], lseek(fd, 0, SEEK_CUR));
-						if (!strncmp(entry.name, get_dir[i], sizeof(get_dir[i])))
-						{
-
-							wrong_input = 0;
-							father_node = entry.inode;
-							found = 1;
-							break;
-						}
-						sss++;
-					} while (1);
-					if (!found)
-						wrong_input = 1;
-				}
-				// if (wrong_input)
-				// 	break;
-				if (found)
-				{
-					// printf("new node : %d\n", father_node);
-					break;
-				}
-			}
+	arena_init(&e.image_arena, 4096);
+	arena_init(&e.scratch, ARENA_DEFAULT_CHUNK);
+	arena_init(&e.nodes, ARENA_DEFAULT_CHUNK);
+
+	/* open device */
+	e.data_fd = -1;
+	if (index)
+	{
+		/* no metadata is read from the image, only file data for cat */
+		e.use_index = 1;
+		e.img.fd = -1;
+		if (fs_index_open(&e.idx, index) < 0)
+		{
+			perror(index);
+			exit(1);
 		}
-		else
+		if (!strcmp(cmd, "cat") &&
+			((e.data_fd = open(device, O_RDONLY)) < 0 || fs_index_check_image(&e.idx, e.data_fd) < 0))
 		{
-			for (size_t block = 0; block < 15; block++)
-			{
+			perror(device);
+			exit(1);
+		}
+	}
+	else if (fs_open(&e.img, device, &e.image_arena) < 0)
+	{
+		if (errno == EINVAL)
+			fprintf(stderr, "%s: Not a Ext2 filesystem\n", device);
+		else
+			perror(device);
+		exit(1); /* error while opening the floppy device */
+	}
+	else if (generic)
+	{
+		fs_use_generic(&e.img);
+	}
+	if (planned && !e.use_index)
+	{
+		if (fs_plan_init(&plan, &e.img, FS_PLAN_MAX_GAP, FS_PLAN_MAX_READ) < 0)
+			errno_exit("fs_plan_init");
+		e.plan = &plan;
+	}
 
-				int found = 0;
-				if (this_inode.i_block[block] != 0)
-				{
-					// printf("inode block : %d\n", this_inode.i_block[block]);
-					char buffer[block_size];
-					lseek(fd, FIND_BLOCK_OFFSET(this_inode.i_block[block]), SEEK_SET);
-					ssize_t bytes_read = read(fd, buffer, block_size);
-					printf("file content ---------------> \n "
-							"%s \n"
-					,buffer);
-				}
-			}
+	int status = 0;
+	if (!strcmp(cmd, "index") && !e.use_index)
+	{
+		if (npaths != 1)
+			usage(argv[0]);
+		explorer_reset(&e);
+		if (cmd_index(&e, paths[0]) < 0)
+		{
+			perror(paths[0]);
+			status = 1;
 		}
-		if (wrong_input)
+	}
+	else if (!strcmp(cmd, "du") && !e.use_index)
+	{
+		if (npaths > 1)
+			usage(argv[0]);
+		if (fs_du(&e.img, workers, npaths ? atoi(paths[0]) : 20, stdout) < 0)
 		{
-			printf("wrong input shit\n");
-			break;
+			perror("du");
+			status = 1;
+		}
+	}
+	else if (!strcmp(cmd, "info") && !e.use_index)
+	{
+		explorer_reset(&e);
+		if (cmd_info(&e) < 0)
+		{
+			perror("info");
+			status = 1;
+		}
+	}
+	else if (!strcmp(cmd, "stat") || !strcmp(cmd, "cat") || !strcmp(cmd, "ls") || !strcmp(cmd, "walk"))
+	{
+		if (npaths == 0)
+		{
+			if (!strcmp(cmd, "stat") || !strcmp(cmd, "cat"))
+				usage(argv[0]);
+			paths = root_only;
+			npaths = 1;
 		}
+		for (int i = 0; i < npaths; i++)
+		{
+			int ret;
+			explorer_reset(&e);
+			if (e.use_index && !strcmp(cmd, "stat"))
+				ret = idx_stat(&e, paths[i]);
+			else if (e.use_index && !strcmp(cmd, "cat"))
+				ret = idx_cat(&e, paths[i]);
+			else if (e.use_index)
+				ret = idx_walk(&e, paths[i], !strcmp(cmd, "ls"));
+			else if (!strcmp(cmd, "stat"))
+				ret = cmd_stat(&e, paths[i]);
+			else if (!strcmp(cmd, "cat"))
+				ret = cmd_cat(&e, paths[i]);
+			else
+				ret = cmd_walk(&e, paths[i], !strcmp(cmd, "ls"));
+			if (ret < 0)
+			{
+				perror(paths[i]);
+				status = 1;
+			}
+		}
+	}
+	else
+	{
+		usage(argv[0]);
+	}
+
+	if (report)
+	{
+		arena_report(&e.scratch, "scratch arena");
+		arena_report(&e.nodes, "inode arena");
 	}
 
-	close(fd);
-	exit(0);
+	if (e.plan)
+		fs_plan_free(e.plan);
+	fs_close(&e.img);
+	fs_index_close(&e.idx);
+	if (e.data_fd >= 0)
+		close(e.data_fd);
+	arena_free(&e.scratch);
+	arena_free(&e.nodes);
+	arena_free(&e.image_arena);
+	exit(status);
 } /* main() */
@@ -0,0 +1,216 @@
+/*
+	Block-size specialized kernels. fs-image.c includes this once per
+	supported block size with FS_BS and FS_BS_LOG set, and once more with
+	FS_BS 0 for the generic variant that reads the size from the image.
+	With a constant size every shift, mask and loop bound below is folded
+	at compile time; fs_open() picks the variant matching the image.
+*/
+
+#define FS_VARIANT(name) FS_VARIANT_(name, FS_BS)
+#define FS_VARIANT_(name, bs) FS_VARIANT__(name, bs)
+#define FS_VARIANT__(name, bs) name##_##bs
+
+#if FS_BS
+#define BS ((u32)FS_BS)
+#define BS_LOG FS_BS_LOG
+#else
+#define BS (img->block_size)
+#define BS_LOG (img->super.s_log_block_size + 10)
+#endif
+#define PTR_SHIFT (BS_LOG - 2) /* log2 of block numbers per indirect block */
+
+static int FS_VARIANT(block_map)(const struct fs_image *img, const struct ext2_inode *inode, u32 lblock,
+								 u32 *pblock)
+{
+	const u32 shift = PTR_SHIFT;
+
+	if (lblock < EXT2_NDIR_BLOCKS)
+	{
+		*pblock = inode->i_block[lblock];
+		return 0;
+	}
+	lblock -= EXT2_NDIR_BLOCKS;
+
+	u32 levels, top;
+	if (lblock < 1u << shift)
+	{
+		levels = 1;
+		top = inode->i_block[EXT2_IND_BLOCK];
+	}
+	else if ((lblock -= 1u << shift) < 1u << 2 * shift)
+	{
+		levels = 2;
+		top = inode->i_block[EXT2_DIND_BLOCK];
+	}
+	else
+	{
+		lblock -= 1u << 2 * shift;
+		levels = 3;
+		top = inode->i_block[EXT2_TIND_BLOCK];
+	}
+
+	u32 block = top;
+	while (levels-- > 0 && block != 0)
+	{
+		u32 index = lblock >> levels * shift;
+		if (read_indirect(img, block, ((off_t)block << BS_LOG) + (off_t)index * 4, &block) < 0)
+		{
+			return -1;
+		}
+		lblock &= (1u << levels * shift) - 1;
+	}
+	*pblock = block;
+	return 0;
+}
+
+/* entries of one directory block from *off on; *off is left on the entry fn stopped at */
+static int FS_VARIANT(dir_block)(const struct fs_image *img, const unsigned char *buf, u32 *off, fs_dir_fn fn,
+								 void *ctx)
+{
+	u32 o = *off;
+	int ret = 0;
+	while (o + 8 <= BS)
+	{
+		const struct ext2_dir_entry *entry = (const struct ext2_dir_entry *)(buf + o);
+		u32 name_len = img->filetype ? (entry->name_len & 0xff) : entry->name_len;
+		if (entry->rec_len < 8 || o + entry->rec_len > BS || 8 + name_len > entry->rec_len)
+		{
+			errno = EINVAL; /* corrupted directory block */
+			ret = -1;
+			break;
+		}
+		if (entry->inode != 0)
+		{
+			if ((ret = fn(ctx, entry->inode, (const char *)entry->name, name_len)) != 0)
+			{
+				break;
+			}
+		}
+		o += entry->rec_len;
+	}
+	*off = o;
+	return ret;
+}
+
+static int FS_VARIANT(dir_iterate_at)(const struct fs_image *img, const struct ext2_inode *dir,
+									  struct arena *a, u64 *pos, fs_dir_fn fn, void *ctx)
+{
+	if (!fs_is_dir(dir))
+	{
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	struct arena_mark mark = arena_mark(a);
+	unsigned char *buf = arena_alloc(a, BS);
+	if (buf == NULL)
+	{
+		return -1;
+	}
+
+	int ret = 0;
+	u32 nblocks = (dir->i_size + BS - 1) >> BS_LOG;
+	u32 lblock = *pos >> BS_LOG;
+	u32 off = *pos & (BS - 1);
+	for (; lblock < nblocks && ret == 0; lblock++, off = 0)
+	{
+		u32 block;
+		if (FS_VARIANT(block_map)(img, dir, lblock, &block) < 0)
+		{
+			ret = -1;
+			break;
+		}
+		if (block == 0)
+		{
+			continue;
+		}
+		if (block >= img->super.s_blocks_count)
+		{
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		if (pread_full(img->fd, buf, BS, (off_t)block << BS_LOG) < 0)
+		{
+			ret = -1;
+			break;
+		}
+
+		if ((ret = FS_VARIANT(dir_block)(img, buf, &off, fn, ctx)) != 0)
+		{
+			break;
+		}
+	}
+	*pos = ((u64)lblock << BS_LOG) + off;
+	if (lblock >= nblocks)
+	{
+		*pos = (u64)nblocks << BS_LOG;
+	}
+
+	arena_rewind(a, mark);
+	return ret < 0 ? -1 : ret;
+}
+
+/* first set bit in [from, nbits), nbits if there is none */
+static u32 FS_VARIANT(bitmap_next)(const struct fs_image *img, const unsigned char *bitmap, u32 nbits,
+								   u32 from)
+{
+	(void)img;
+	if (nbits > BS * 8)
+	{
+		nbits = BS * 8; /* a bitmap is one block */
+	}
+	while (from < nbits && from % 64 != 0)
+	{
+		if (bitmap[from / 8] & (1 << (from % 8)))
+			return from;
+		from++;
+	}
+	/* whole 64-bit words; bit i of byte k is bit 8k + i of a little-endian load */
+	for (; from + 64 <= nbits; from += 64)
+	{
+		u64 word;
+		memcpy(&word, bitmap + from / 8, sizeof(word));
+		if (word != 0)
+			return from + __builtin_ctzll(word);
+	}
+	for (; from < nbits; from++)
+	{
+		if (bitmap[from / 8] & (1 << (from % 8)))
+			return from;
+	}
+	return nbits;
+}
+
+/* set bits among the first nbits */
+static u32 FS_VARIANT(bitmap_count)(const struct fs_image *img, const unsigned char *bitmap, u32 nbits)
+{
+	(void)img;
+	if (nbits > BS * 8)
+	{
+		nbits = BS * 8;
+	}
+	u32 count = 0;
+	u32 words = nbits / 64;
+	for (u32 i = 0; i < words; i++)
+	{
+		u64 word;
+		memcpy(&word, bitmap + i * 8, sizeof(word));
+		/* plain SWAR popcount: vectorizes, where the builtin is a libgcc call */
+		word -= (word >> 1) & 0x5555555555555555ull;
+		word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+		word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0full;
+		count += (word * 0x0101010101010101ull) >> 56;
+	}
+	for (u32 i = words * 64; i < nbits; i++)
+	{
+		count += (bitmap[i / 8] >> (i % 8)) & 1;
+	}
+	return count;
+}
+
+#undef PTR_SHIFT
+#undef BS_LOG
+#undef BS
+#undef FS_BS_LOG
+#undef FS_BS
@@ -0,0 +1,469 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "fs-image.h"
+
+static int pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+		{
+			errno = EIO; /* image shorter than its metadata claims */
+			return -1;
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* one entry of indirect block `block`, found at byte offset off of the image */
+static int read_indirect(const struct fs_image *img, u32 block, off_t off, u32 *out)
+{
+	if (block >= img->super.s_blocks_count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return pread_full(img->fd, out, sizeof(*out), off);
+}
+
+struct fs_image_ops
+{
+	u32 block_size; /* 0: any */
+	int (*block_map)(const struct fs_image *img, const struct ext2_inode *inode, u32 lblock, u32 *pblock);
+	int (*dir_block)(const struct fs_image *img, const unsigned char *buf, u32 *off, fs_dir_fn fn, void *ctx);
+	int (*dir_iterate_at)(const struct fs_image *img, const struct ext2_inode *dir, struct arena *a,
+						  u64 *pos, fs_dir_fn fn, void *ctx);
+	u32 (*bitmap_next)(const struct fs_image *img, const unsigned char *bitmap, u32 nbits, u32 from);
+	u32 (*bitmap_count)(const struct fs_image *img, const unsigned char *bitmap, u32 nbits);
+};
+
+#define FS_BS 1024
+#define FS_BS_LOG 10
+#include "fs-image-bs.h"
+#define FS_BS 2048
+#define FS_BS_LOG 11
+#include "fs-image-bs.h"
+#define FS_BS 4096
+#define FS_BS_LOG 12
+#include "fs-image-bs.h"
+#define FS_BS 0
+#include "fs-image-bs.h"
+
+#define FS_IMAGE_OPS(bs) \
+	{bs, block_map_##bs, dir_block_##bs, dir_iterate_at_##bs, bitmap_next_##bs, bitmap_count_##bs}
+
+/* the generic variant last, it takes any block size */
+static const struct fs_image_ops image_ops[] = {
+	FS_IMAGE_OPS(1024),
+	FS_IMAGE_OPS(2048),
+	FS_IMAGE_OPS(4096),
+	FS_IMAGE_OPS(0),
+};
+
+int fs_open(struct fs_image *img, const char *path, struct arena *a)
+{
+	memset(img, 0, sizeof(*img));
+	img->path = path;
+	if ((img->fd = open(path, O_RDONLY)) < 0)
+	{
+		return -1;
+	}
+
+	if (pread_full(img->fd, &img->super, sizeof(img->super), SUPERBLOCK_OFFSET) < 0)
+	{
+		goto fail;
+	}
+	if (img->super.s_magic != EXT2_SUPER_MAGIC || img->super.s_log_block_size > 6 ||
+		img->super.s_blocks_per_group == 0 || img->super.s_inodes_per_group == 0)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	img->block_size = 1024 << img->super.s_log_block_size;
+	img->inode_size = img->super.s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_INODE_SIZE
+																   : img->super.s_inode_size;
+	if (img->inode_size < EXT2_GOOD_OLD_INODE_SIZE)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	img->filetype = img->super.s_rev_level != EXT2_GOOD_OLD_REV &&
+					(img->super.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE);
+	img->ops = image_ops;
+	while (img->ops->block_size != 0 && img->ops->block_size != img->block_size)
+	{
+		img->ops++;
+	}
+
+	/*
+		We dont take the reserved GDT entries into account at least now :)
+	*/
+	img->groups = (img->super.s_blocks_count - img->super.s_first_data_block +
+				   img->super.s_blocks_per_group - 1) /
+				  img->super.s_blocks_per_group;
+	/* every inode number must fall in a group that has a descriptor */
+	if (img->groups == 0 || img->super.s_inodes_count > (u64)img->groups * img->super.s_inodes_per_group)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	size_t gdt_size = img->groups * sizeof(struct ext2_block_group_descriptor);
+	if ((img->gdt = arena_alloc(a, gdt_size)) == NULL)
+	{
+		goto fail;
+	}
+	if (pread_full(img->fd, img->gdt, gdt_size,
+				   FIND_BLOCK_OFFSET(img, img->super.s_first_data_block + 1)) < 0)
+	{
+		goto fail;
+	}
+	return 0;
+
+fail:;
+	int err = errno;
+	close(img->fd);
+	img->fd = -1;
+	errno = err;
+	return -1;
+}
+
+/* drop to the block-size independent kernels, to compare against them */
+void fs_use_generic(struct fs_image *img)
+{
+	img->ops = &image_ops[sizeof(image_ops) / sizeof(image_ops[0]) - 1];
+}
+
+void fs_close(struct fs_image *img)
+{
+	if (img->fd >= 0)
+	{
+		close(img->fd);
+	}
+	img->fd = -1;
+}
+
+int fs_read_block(const struct fs_image *img, u32 block, void *buf)
+{
+	if (block >= img->super.s_blocks_count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return pread_full(img->fd, buf, img->block_size, FIND_BLOCK_OFFSET(img, block));
+}
+
+/* count consecutive blocks in one read */
+int fs_read_blocks(const struct fs_image *img, u32 block, u32 count, void *buf)
+{
+	if (block >= img->super.s_blocks_count || count > img->super.s_blocks_count - block)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return pread_full(img->fd, buf, (size_t)count * img->block_size, FIND_BLOCK_OFFSET(img, block));
+}
+
+/* len bytes at byte offset off of the image, for callers batching their own reads */
+int fs_read_raw(const struct fs_image *img, off_t off, size_t len, void *buf)
+{
+	return pread_full(img->fd, buf, len, off);
+}
+
+/* where inode ino lives in the image, -1 for a bad number */
+off_t fs_inode_offset(const struct fs_image *img, u32 ino)
+{
+	if (ino < 1 || ino > img->super.s_inodes_count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	/* Inodes start at 1 lol :D */
+	u32 group = (ino - 1) / img->super.s_inodes_per_group;
+	u32 index = (ino - 1) % img->super.s_inodes_per_group;
+	if (group >= img->groups)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return FIND_BLOCK_OFFSET(img, img->gdt[group].bg_inode_table) + (off_t)index * img->inode_size;
+}
+
+int fs_read_inode(const struct fs_image *img, u32 ino, struct ext2_inode *inode)
+{
+	off_t off = fs_inode_offset(img, ino);
+	if (off < 0)
+	{
+		return -1;
+	}
+	return pread_full(img->fd, inode, sizeof(*inode), off);
+}
+
+
+/* logical -> physical block, 0 for a hole */
+int fs_block_map(const struct fs_image *img, const struct ext2_inode *inode, u32 lblock, u32 *pblock)
+{
+	return img->ops->block_map(img, inode, lblock, pblock);
+}
+
+/*
+	Iterate entries starting at byte position *pos of the directory (0 for
+	the start). When fn stops the iteration *pos is left at the entry it
+	stopped on, so a later call resumes there (readdir cookies).
+*/
+int fs_dir_iterate_at(const struct fs_image *img, const struct ext2_inode *dir, struct arena *a,
+					  u64 *pos, fs_dir_fn fn, void *ctx)
+{
+	return img->ops->dir_iterate_at(img, dir, a, pos, fn, ctx);
+}
+
+/* entries of a directory block the caller already read */
+int fs_dir_block(const struct fs_image *img, const void *buf, fs_dir_fn fn, void *ctx)
+{
+	u32 off = 0;
+	int ret = img->ops->dir_block(img, buf, &off, fn, ctx);
+	return ret < 0 ? -1 : ret;
+}
+
+int fs_dir_iterate(const struct fs_image *img, const struct ext2_inode *dir, struct arena *a,
+				   fs_dir_fn fn, void *ctx)
+{
+	u64 pos = 0;
+	return fs_dir_iterate_at(img, dir, a, &pos, fn, ctx);
+}
+
+struct walk_ctx
+{
+	const struct fs_image *img;
+	struct arena *scratch;
+	struct slab *inodes;
+	fs_walk_fn fn;
+	void *ctx;
+	char *path; /* shared buffer, grown and cut back like a stack */
+	size_t path_len;
+	int depth;
+	int max_depth;
+};
+
+static int walk_dir(struct walk_ctx *w, const struct ext2_inode *dir);
+
+static int walk_entry(void *ctx, u32 ino, const char *name, size_t name_len)
+{
+	struct walk_ctx *w = ctx;
+	if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.'))
+	{
+		return 0;
+	}
+
+	size_t saved = w->path_len;
+	if (saved + 1 + name_len + 1 > FS_PATH_MAX)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (saved == 0 || w->path[saved - 1] != '/')
+	{
+		w->path[w->path_len++] = '/';
+	}
+	memcpy(w->path + w->path_len, name, name_len);
+	w->path_len += name_len;
+	w->path[w->path_len] = '\0';
+
+	struct ext2_inode *inode = slab_alloc(w->inodes);
+	int ret = inode == NULL ? -1 : fs_read_inode(w->img, ino, inode);
+	if (ret == 0)
+	{
+		ret = w->fn(w->ctx, w->path, w->path_len, ino, inode);
+		if (ret == 0 && fs_is_dir(inode) && (w->max_depth < 0 || w->depth < w->max_depth))
+		{
+			ret = walk_dir(w, inode);
+		}
+	}
+	if (inode)
+	{
+		slab_free(w->inodes, inode);
+	}
+
+	w->path_len = saved;
+	w->path[saved] = '\0';
+	return ret;
+}
+
+static int walk_dir(struct walk_ctx *w, const struct ext2_inode *dir)
+{
+	w->depth++;
+	int ret = fs_dir_iterate(w->img, dir, w->scratch, walk_entry, w);
+	w->depth--;
+	return ret;
+}
+
+/*
+	Depth-first walk below path (not reporting path itself). Memory is one
+	block buffer and one slab inode per level plus a single path buffer,
+	so the walk runs in bounded memory whatever the number of entries.
+	max_depth < 0 means unlimited, 1 lists just the directory.
+*/
+int fs_walk(const struct fs_image *img, const char *path, int max_depth, struct arena *scratch,
+			struct slab *inodes, fs_walk_fn fn, void *ctx)
+{
+	struct walk_ctx w = {img, scratch, inodes, fn, ctx, NULL, 0, 0, max_depth};
+	struct arena_mark mark = arena_mark(scratch);
+	struct ext2_inode *dir = slab_alloc(inodes);
+	u32 ino;
+	int ret = -1;
+
+	if (dir == NULL || (w.path = arena_alloc(scratch, FS_PATH_MAX)) == NULL ||
+		fs_lookup(img, path, scratch, &ino) < 0 || fs_read_inode(img, ino, dir) < 0)
+	{
+		goto out;
+	}
+
+	w.path_len = strlen(path);
+	if (w.path_len >= FS_PATH_MAX)
+	{
+		errno = ENAMETOOLONG;
+		goto out;
+	}
+	memcpy(w.path, path, w.path_len + 1);
+	ret = walk_dir(&w, dir);
+
+out:
+	if (dir)
+	{
+		slab_free(inodes, dir);
+	}
+	arena_rewind(scratch, mark);
+	return ret;
+}
+
+struct lookup_ctx
+{
+	const char *name;
+	size_t len;
+	u32 ino;
+};
+
+static int lookup_entry(void *ctx, u32 ino, const char *name, size_t name_len)
+{
+	struct lookup_ctx *l = ctx;
+	if (name_len == l->len && memcmp(name, l->name, name_len) == 0)
+	{
+		l->ino = ino;
+		return 1;
+	}
+	return 0;
+}
+
+int fs_lookup(const struct fs_image *img, const char *path, struct arena *a, u32 *ino)
+{
+	u32 current = EXT2_ROOT_INO;
+	while (*path)
+	{
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+
+		size_t len = strcspn(path, "/");
+		struct ext2_inode inode;
+		if (fs_read_inode(img, current, &inode) < 0)
+		{
+			return -1;
+		}
+
+		struct lookup_ctx l = {path, len, 0};
+		int ret = fs_dir_iterate(img, &inode, a, lookup_entry, &l);
+		if (ret < 0)
+		{
+			return -1;
+		}
+		if (ret == 0)
+		{
+			errno = ENOENT;
+			return -1;
+		}
+		current = l.ino;
+		path += len;
+	}
+	*ino = current;
+	return 0;
+}
+
+ssize_t fs_read(const struct fs_image *img, const struct ext2_inode *inode, u64 off,
+				void *buf, size_t len)
+{
+	u64 size = fs_inode_size(inode);
+	if (off >= size)
+	{
+		return 0;
+	}
+	if (len > size - off)
+	{
+		len = size - off;
+	}
+
+	if (fs_is_fast_symlink(inode))
+	{
+		/* the target lives in i_block, a larger size is corrupt */
+		if (size > sizeof(inode->i_block))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(buf, (const char *)inode->i_block + off, len);
+		return len;
+	}
+
+	char *p = buf;
+	size_t done = 0;
+	while (done < len)
+	{
+		u32 lblock = (off + done) / img->block_size;
+		u32 in_block = (off + done) % img->block_size;
+		size_t n = img->block_size - in_block;
+		if (n > len - done)
+		{
+			n = len - done;
+		}
+
+		u32 block;
+		if (fs_block_map(img, inode, lblock, &block) < 0)
+		{
+			return -1;
+		}
+		if (block == 0)
+		{
+			memset(p + done, 0, n);
+		}
+		else if (pread_full(img->fd, p + done, n, FIND_BLOCK_OFFSET(img, block) + in_block) < 0)
+		{
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+u32 fs_bitmap_next(const struct fs_image *img, const unsigned char *bitmap, u32 nbits, u32 from)
+{
+	return img->ops->bitmap_next(img, bitmap, nbits, from);
+}
+
+u32 fs_bitmap_count(const struct fs_image *img, const unsigned char *bitmap, u32 nbits)
+{
+	return img->ops->bitmap_count(img, bitmap, nbits);
+}
@@ -0,0 +1,66 @@
+#ifndef FS_IMAGE_H
+#define FS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ext2-headers.h"
+#include "fs-arena.h"
+
+#define SUPERBLOCK_OFFSET 1024
+#define FS_PATH_MAX 4096
+#define FIND_BLOCK_OFFSET(img, i) ((off_t)(img)->block_size * (i))
+
+struct fs_image_ops;
+
+/* an opened image; everything here is read-only once fs_open() returns */
+struct fs_image
+{
+	int fd;
+	const char *path;
+	struct ext2_superblock super;
+	u32 block_size;
+	u32 inode_size;
+	u32 groups;
+	int filetype; /* name_len is 8 bits + file type */
+	struct ext2_block_group_descriptor *gdt;
+	const struct fs_image_ops *ops; /* kernels specialized for block_size */
+};
+
+/* return 0 to keep going, > 0 to stop, < 0 to fail the iteration */
+typedef int (*fs_dir_fn)(void *ctx, u32 ino, const char *name, size_t name_len);
+/* same convention; path is NUL terminated and only valid during the call */
+typedef int (*fs_walk_fn)(void *ctx, const char *path, size_t path_len, u32 ino,
+						  const struct ext2_inode *inode);
+
+int fs_open(struct fs_image *img, const char *path, struct arena *a);
+void fs_use_generic(struct fs_image *img);
+void fs_close(struct fs_image *img);
+int fs_read_block(const struct fs_image *img, u32 block, void *buf);
+int fs_read_blocks(const struct fs_image *img, u32 block, u32 count, void *buf);
+int fs_read_raw(const struct fs_image *img, off_t off, size_t len, void *buf);
+off_t fs_inode_offset(const struct fs_image *img, u32 ino);
+int fs_read_inode(const struct fs_image *img, u32 ino, struct ext2_inode *inode);
+int fs_block_map(const struct fs_image *img, const struct ext2_inode *inode, u32 lblock, u32 *pblock);
+int fs_dir_block(const struct fs_image *img, const void *buf, fs_dir_fn fn, void *ctx);
+int fs_dir_iterate(const struct fs_image *img, const struct ext2_inode *dir, struct arena *a,
+				   fs_dir_fn fn, void *ctx);
+int fs_dir_iterate_at(const struct fs_image *img, const struct ext2_inode *dir, struct arena *a,
+					  u64 *pos, fs_dir_fn fn, void *ctx);
+int fs_walk(const struct fs_image *img, const char *path, int max_depth, struct arena *scratch,
+			struct slab *inodes, fs_walk_fn fn, void *ctx);
+int fs_lookup(const struct fs_image *img, const char *path, struct arena *a, u32 *ino);
+ssize_t fs_read(const struct fs_image *img, const struct ext2_inode *inode, u64 off,
+				void *buf, size_t len);
+/* bitmap blocks: next set bit at or after from (nbits if none), set bits */
+u32 fs_bitmap_next(const struct fs_image *img, const unsigned char *bitmap, u32 nbits, u32 from);
+u32 fs_bitmap_count(const struct fs_image *img, const unsigned char *bitmap, u32 nbits);
+
+#define fs_is_dir(inode) (((inode)->i_mode & 0xF000) == EXT2_S_IFDIR)
+#define fs_is_reg(inode) (((inode)->i_mode & 0xF000) == EXT2_S_IFREG)
+#define fs_is_lnk(inode) (((inode)->i_mode & 0xF000) == EXT2_S_IFLNK)
+/* symlinks short enough to live in i_block */
+#define fs_is_fast_symlink(inode) (fs_is_lnk(inode) && (inode)->i_blocks == 0)
+/* i_dir_acl holds the high 32 size bits of regular files */
+#define fs_inode_size(inode) ((inode)->i_size | (fs_is_reg(inode) ? (u64)(inode)->i_dir_acl << 32 : 0))
+
+#endif /* FS_IMAGE_H */
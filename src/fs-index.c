@@ -0,0 +1,543 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fs-index.h"
+#include "fs-io.h"
+#include "fs-plan.h"
+
+/*
+	Building is a one-off pass over the whole tree, so the tables simply
+	grow by doubling; only lookups are meant to be cheap.
+*/
+struct index_builder
+{
+	const struct fs_image *img;
+	struct fs_index_path *paths;
+	size_t npaths, paths_cap;
+	struct fs_index_inode *inodes;
+	size_t ninodes, inodes_cap;
+	struct fs_index_extent *extents;
+	size_t nextents, extents_cap;
+	char *strings;
+	size_t strings_len, strings_cap;
+	unsigned char *seen; /* one bit per inode already recorded */
+};
+
+static int add_string(struct index_builder *b, const char *s, size_t len, u32 *off)
+{
+	if (b->strings_len + len + 1 > UINT32_MAX)
+	{
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (array_grow(&b->strings, &b->strings_cap, b->strings_len + len + 1, 1) < 0)
+	{
+		return -1;
+	}
+	*off = b->strings_len;
+	memcpy(b->strings + b->strings_len, s, len);
+	b->strings[b->strings_len + len] = '\0';
+	b->strings_len += len + 1;
+	return 0;
+}
+
+static int add_extents(struct index_builder *b, const struct ext2_inode *inode, struct fs_index_inode *rec)
+{
+	u32 bs = b->img->block_size;
+	u32 nblocks = (fs_inode_size(inode) + bs - 1) / bs;
+	struct fs_index_extent *last = NULL;
+
+	rec->extent_first = b->nextents;
+	for (u32 lblock = 0; lblock < nblocks; lblock++)
+	{
+		u32 pblock;
+		if (fs_block_map(b->img, inode, lblock, &pblock) < 0)
+		{
+			return -1;
+		}
+		if (pblock == 0)
+		{
+			last = NULL; /* hole */
+			continue;
+		}
+		if (last && last->lblock + last->len == lblock && last->pblock + last->len == pblock)
+		{
+			last->len++;
+			continue;
+		}
+		if (array_grow(&b->extents, &b->extents_cap, b->nextents + 1, sizeof(*b->extents)) < 0)
+		{
+			return -1;
+		}
+		last = &b->extents[b->nextents++];
+		last->lblock = lblock;
+		last->pblock = pblock;
+		last->len = 1;
+	}
+	rec->extent_count = b->nextents - rec->extent_first;
+	return 0;
+}
+
+static int add_inode(struct index_builder *b, u32 ino, const struct ext2_inode *inode)
+{
+	if (b->seen[(ino - 1) / 8] & (1 << ((ino - 1) % 8)))
+	{
+		return 0; /* another hard link */
+	}
+	b->seen[(ino - 1) / 8] |= 1 << ((ino - 1) % 8);
+
+	if (array_grow(&b->inodes, &b->inodes_cap, b->ninodes + 1, sizeof(*b->inodes)) < 0)
+	{
+		return -1;
+	}
+	struct fs_index_inode *rec = &b->inodes[b->ninodes++];
+	memset(rec, 0, sizeof(*rec));
+	rec->ino = ino;
+	rec->mode = inode->i_mode;
+	rec->links_count = inode->i_links_count;
+	rec->uid = inode->i_uid;
+	rec->gid = inode->i_gid;
+	rec->size = fs_inode_size(inode);
+	rec->atime = inode->i_atime;
+	rec->ctime = inode->i_ctime;
+	rec->mtime = inode->i_mtime;
+	rec->blocks = inode->i_blocks;
+	rec->flags = inode->i_flags;
+
+	if (fs_is_fast_symlink(inode))
+	{
+		size_t len = inode->i_size < sizeof(inode->i_block) ? inode->i_size : sizeof(inode->i_block);
+		return add_string(b, (const char *)inode->i_block, len, &rec->extent_first);
+	}
+	return add_extents(b, inode, rec);
+}
+
+static int add_path(void *ctx, const char *path, size_t path_len, u32 ino, const struct ext2_inode *inode)
+{
+	struct index_builder *b = ctx;
+	if (array_grow(&b->paths, &b->paths_cap, b->npaths + 1, sizeof(*b->paths)) < 0)
+	{
+		return -1;
+	}
+	struct fs_index_path *p = &b->paths[b->npaths];
+	memset(p, 0, sizeof(*p));
+	p->ino = ino;
+	p->name_len = path_len;
+	if (add_string(b, path, path_len, &p->name_off) < 0)
+	{
+		return -1;
+	}
+	b->npaths++;
+	return add_inode(b, ino, inode);
+}
+
+static int path_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+	if (c != 0)
+	{
+		return c;
+	}
+	return (alen > blen) - (alen < blen);
+}
+
+struct sort_path
+{
+	const char *name;
+	struct fs_index_path path;
+};
+
+static int sort_path_cmp(const void *a, const void *b)
+{
+	const struct sort_path *x = a, *y = b;
+	return path_cmp(x->name, x->path.name_len, y->name, y->path.name_len);
+}
+
+static int sort_inode_cmp(const void *a, const void *b)
+{
+	const struct fs_index_inode *x = a, *y = b;
+	return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static int write_index(struct index_builder *b, const char *out)
+{
+	struct stat st;
+	if (fstat(b->img->fd, &st) < 0)
+	{
+		return -1;
+	}
+
+	struct sort_path *sorted = malloc((b->npaths ? b->npaths : 1) * sizeof(*sorted));
+	if (sorted == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < b->npaths; i++)
+	{
+		sorted[i].name = b->strings + b->paths[i].name_off;
+		sorted[i].path = b->paths[i];
+	}
+	qsort(sorted, b->npaths, sizeof(*sorted), sort_path_cmp);
+	for (size_t i = 0; i < b->npaths; i++)
+	{
+		b->paths[i] = sorted[i].path;
+	}
+	free(sorted);
+	qsort(b->inodes, b->ninodes, sizeof(*b->inodes), sort_inode_cmp);
+
+	struct fs_index_header hdr = {0};
+	hdr.magic = FS_INDEX_MAGIC;
+	hdr.version = FS_INDEX_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.block_size = b->img->block_size;
+	hdr.image_size = st.st_size;
+	hdr.image_mtime = st.st_mtime;
+	memcpy(hdr.uuid, b->img->super.s_uuid, sizeof(hdr.uuid));
+	hdr.path_count = b->npaths;
+	hdr.inode_count = b->ninodes;
+	hdr.extent_count = b->nextents;
+	hdr.paths_off = ALIGN8(sizeof(hdr));
+	hdr.inodes_off = ALIGN8(hdr.paths_off + b->npaths * sizeof(*b->paths));
+	hdr.extents_off = ALIGN8(hdr.inodes_off + b->ninodes * sizeof(*b->inodes));
+	hdr.strings_off = ALIGN8(hdr.extents_off + b->nextents * sizeof(*b->extents));
+	hdr.strings_size = b->strings_len;
+	hdr.file_size = ALIGN8(hdr.strings_off + b->strings_len);
+
+	struct fs_out o;
+	if (fs_out_open(&o, out) < 0)
+	{
+		return -1;
+	}
+	if (fs_out_section(&o, &hdr, sizeof(hdr)) < 0 ||
+		fs_out_section(&o, b->paths, b->npaths * sizeof(*b->paths)) < 0 ||
+		fs_out_section(&o, b->inodes, b->ninodes * sizeof(*b->inodes)) < 0 ||
+		fs_out_section(&o, b->extents, b->nextents * sizeof(*b->extents)) < 0 ||
+		fs_out_section(&o, b->strings, b->strings_len) < 0)
+	{
+		fs_out_abort(&o);
+		return -1;
+	}
+	return fs_out_commit(&o);
+}
+
+int fs_index_build(const struct fs_image *img, struct arena *scratch, const char *out)
+{
+	struct index_builder b = {0};
+	struct ext2_inode root;
+	int ret = -1;
+
+	b.img = img;
+	if ((b.seen = calloc((img->super.s_inodes_count + 7) / 8, 1)) == NULL)
+	{
+		return -1;
+	}
+	/* paths are sorted when written, so the walk may go in disk order */
+	struct fs_plan plan;
+	if (fs_plan_init(&plan, img, FS_PLAN_MAX_GAP, FS_PLAN_MAX_READ) < 0)
+	{
+		free(b.seen);
+		return -1;
+	}
+	if (fs_read_inode(img, EXT2_ROOT_INO, &root) == 0 && add_path(&b, "/", 1, EXT2_ROOT_INO, &root) == 0 &&
+		fs_walk_planned(img, "/", -1, scratch, &plan, add_path, &b) == 0)
+	{
+		ret = write_index(&b, out);
+	}
+	fs_plan_free(&plan);
+
+	int err = errno;
+	free(b.paths);
+	free(b.inodes);
+	free(b.extents);
+	free(b.strings);
+	free(b.seen);
+	errno = err;
+	return ret;
+}
+
+static int section_ok(const struct fs_index_header *h, u64 off, u64 count, u64 elem)
+{
+	return off % 8 == 0 && off <= h->file_size && count <= (h->file_size - off) / elem;
+}
+
+int fs_index_open(struct fs_index *idx, const char *path)
+{
+	memset(idx, 0, sizeof(*idx));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(struct fs_index_header))
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	idx->size = st.st_size;
+	idx->map = mmap(NULL, idx->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (idx->map == MAP_FAILED)
+	{
+		idx->map = NULL;
+		return -1;
+	}
+
+	const struct fs_index_header *h = idx->map;
+	if (h->magic != FS_INDEX_MAGIC || h->version != FS_INDEX_VERSION || h->header_size != sizeof(*h) ||
+		h->file_size != idx->size ||
+		!section_ok(h, h->paths_off, h->path_count, sizeof(struct fs_index_path)) ||
+		!section_ok(h, h->inodes_off, h->inode_count, sizeof(struct fs_index_inode)) ||
+		!section_ok(h, h->extents_off, h->extent_count, sizeof(struct fs_index_extent)) ||
+		!section_ok(h, h->strings_off, h->strings_size, 1))
+	{
+		fs_index_close(idx);
+		errno = EINVAL;
+		return -1;
+	}
+
+	const char *base = idx->map;
+	idx->hdr = h;
+	idx->paths = (const void *)(base + h->paths_off);
+	idx->inodes = (const void *)(base + h->inodes_off);
+	idx->extents = (const void *)(base + h->extents_off);
+	idx->strings = base + h->strings_off;
+	return 0;
+}
+
+void fs_index_close(struct fs_index *idx)
+{
+	if (idx->map)
+	{
+		munmap(idx->map, idx->size);
+	}
+	memset(idx, 0, sizeof(*idx));
+}
+
+int fs_index_check_image(const struct fs_index *idx, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		return -1;
+	}
+	if ((u64)st.st_size != idx->hdr->image_size || st.st_mtime != idx->hdr->image_mtime)
+	{
+		errno = ESTALE;
+		return -1;
+	}
+	return 0;
+}
+
+const struct fs_index_inode *fs_index_inode(const struct fs_index *idx, u32 ino)
+{
+	u32 lo = 0, hi = idx->hdr->inode_count;
+	while (lo < hi)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+		if (idx->inodes[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < idx->hdr->inode_count && idx->inodes[lo].ino == ino)
+	{
+		return &idx->inodes[lo];
+	}
+	return NULL;
+}
+
+/* "a//b/./c/" -> "/a/b/c" */
+static size_t normalize(const char *path, char *out)
+{
+	size_t len = 0;
+	while (*path)
+	{
+		while (*path == '/')
+			path++;
+		size_t n = strcspn(path, "/");
+		if (n == 0 || (n == 1 && path[0] == '.'))
+		{
+			path += n;
+			continue;
+		}
+		if (len + 1 + n >= FS_PATH_MAX)
+		{
+			return 0;
+		}
+		out[len++] = '/';
+		memcpy(out + len, path, n);
+		len += n;
+		path += n;
+	}
+	if (len == 0)
+	{
+		out[len++] = '/';
+	}
+	out[len] = '\0';
+	return len;
+}
+
+/* first path not sorting before key */
+static u32 lower_bound(const struct fs_index *idx, const char *key, size_t len)
+{
+	u32 lo = 0, hi = idx->hdr->path_count;
+	while (lo < hi)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+		const struct fs_index_path *p = &idx->paths[mid];
+		if (p->name_off + (u64)p->name_len > idx->hdr->strings_size ||
+			path_cmp(fs_index_path_name(idx, p), p->name_len, key, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+const struct fs_index_inode *fs_index_lookup(const struct fs_index *idx, const char *path)
+{
+	char key[FS_PATH_MAX];
+	size_t len = normalize(path, key);
+	if (len == 0)
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	u32 i = lower_bound(idx, key, len);
+	if (i < idx->hdr->path_count && idx->paths[i].name_len == len &&
+		!memcmp(fs_index_path_name(idx, &idx->paths[i]), key, len))
+	{
+		const struct fs_index_inode *inode = fs_index_inode(idx, idx->paths[i].ino);
+		if (inode == NULL)
+			errno = EINVAL;
+		return inode;
+	}
+	errno = ENOENT;
+	return NULL;
+}
+
+/* [first, last) of the paths below path, in sorted order */
+int fs_index_children(const struct fs_index *idx, const char *path, u32 *first, u32 *last)
+{
+	char key[FS_PATH_MAX + 1];
+	size_t len = normalize(path, key);
+	if (len == 0)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (key[len - 1] != '/')
+	{
+		key[len++] = '/';
+	}
+
+	*first = lower_bound(idx, key, len);
+	if (*first < idx->hdr->path_count && idx->paths[*first].name_len == len)
+	{
+		(*first)++; /* the root itself */
+	}
+	key[len - 1] = '/' + 1;
+	*last = lower_bound(idx, key, len);
+	return 0;
+}
+
+/* extent holding lblock, or NULL for a hole */
+static const struct fs_index_extent *find_extent(const struct fs_index *idx,
+												 const struct fs_index_inode *inode, u32 lblock)
+{
+	const struct fs_index_extent *ext = idx->extents + inode->extent_first;
+	u32 lo = 0, hi = inode->extent_count;
+	while (lo < hi)
+	{
+		u32 mid = lo + (hi - lo) / 2;
+		if (ext[mid].lblock + ext[mid].len <= lblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < inode->extent_count && ext[lo].lblock <= lblock)
+	{
+		return &ext[lo];
+	}
+	return NULL;
+}
+
+ssize_t fs_index_read(const struct fs_index *idx, int fd, const struct fs_index_inode *inode,
+					  u64 off, void *buf, size_t len)
+{
+	if (off >= inode->size)
+	{
+		return 0;
+	}
+	if (len > inode->size - off)
+	{
+		len = inode->size - off;
+	}
+
+	if ((inode->mode & 0xF000) == EXT2_S_IFLNK && inode->blocks == 0)
+	{
+		if (inode->extent_first + (u64)inode->size > idx->hdr->strings_size)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(buf, idx->strings + inode->extent_first + off, len);
+		return len;
+	}
+	if ((u64)inode->extent_first + inode->extent_count > idx->hdr->extent_count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	u32 bs = idx->hdr->block_size;
+	char *p = buf;
+	size_t done = 0;
+	while (done < len)
+	{
+		u64 pos = off + done;
+		u32 lblock = pos / bs;
+		const struct fs_index_extent *ext = find_extent(idx, inode, lblock);
+		size_t n;
+		if (ext == NULL)
+		{
+			/* zero up to the next extent (or the end) */
+			n = bs - pos % bs;
+			if (n > len - done)
+				n = len - done;
+			memset(p + done, 0, n);
+		}
+		else
+		{
+			u64 end = (u64)(ext->lblock + ext->len) * bs;
+			n = end - pos < len - done ? end - pos : len - done;
+			off_t at = (off_t)(ext->pblock + (lblock - ext->lblock)) * bs + pos % bs;
+			ssize_t r = pread(fd, p + done, n, at);
+			if (r <= 0)
+			{
+				if (r == 0)
+					errno = EIO;
+				return -1;
+			}
+			n = r;
+		}
+		done += n;
+	}
+	return done;
+}
@@ -0,0 +1,105 @@
+#ifndef FS_INDEX_H
+#define FS_INDEX_H
+
+#include <sys/types.h>
+#include "ext2-headers.h"
+#include "fs-arena.h"
+#include "fs-image.h"
+
+/*
+	Metadata-only sidecar for an immutable image. Layout, all sections
+	8 byte aligned and in host byte order:
+
+		header
+		paths[path_count]       sorted by name (bytewise)
+		inodes[inode_count]     sorted by inode number
+		extents[extent_count]   grouped per inode
+		strings[strings_size]   path names and fast symlink targets
+
+	The file is meant to be mmap()ed and used in place. The image it was
+	built from is identified by size and mtime so stale sidecars are
+	refused instead of answering for a different image.
+*/
+
+#define FS_INDEX_MAGIC 0x58493245 /* "E2IX" */
+#define FS_INDEX_VERSION 1
+
+struct fs_index_header
+{
+	u32 magic;
+	u32 version;
+	u32 header_size;
+	u32 block_size;
+	u64 image_size;
+	i64 image_mtime;
+	u8 uuid[16];
+	u32 path_count;
+	u32 inode_count;
+	u32 extent_count;
+	u32 pad;
+	u64 paths_off;
+	u64 inodes_off;
+	u64 extents_off;
+	u64 strings_off;
+	u64 strings_size;
+	u64 file_size;
+};
+
+struct fs_index_path
+{
+	u32 name_off;
+	u32 name_len;
+	u32 ino;
+	u32 pad;
+};
+
+struct fs_index_inode
+{
+	u32 ino;
+	u16 mode;
+	u16 links_count;
+	u32 uid;
+	u32 gid;
+	u64 size;
+	u32 atime;
+	u32 ctime;
+	u32 mtime;
+	u32 blocks; /* i_blocks, 512 byte units */
+	u32 flags;
+	u32 extent_first; /* or string offset of a fast symlink target */
+	u32 extent_count;
+	u32 pad;
+};
+
+/* lblock .. lblock + len - 1 live at pblock .. pblock + len - 1 */
+struct fs_index_extent
+{
+	u32 lblock;
+	u32 pblock;
+	u32 len;
+};
+
+struct fs_index
+{
+	void *map;
+	size_t size;
+	const struct fs_index_header *hdr;
+	const struct fs_index_path *paths;
+	const struct fs_index_inode *inodes;
+	const struct fs_index_extent *extents;
+	const char *strings;
+};
+
+int fs_index_build(const struct fs_image *img, struct arena *scratch, const char *out);
+int fs_index_open(struct fs_index *idx, const char *path);
+void fs_index_close(struct fs_index *idx);
+int fs_index_check_image(const struct fs_index *idx, int fd);
+const struct fs_index_inode *fs_index_inode(const struct fs_index *idx, u32 ino);
+const struct fs_index_inode *fs_index_lookup(const struct fs_index *idx, const char *path);
+int fs_index_children(const struct fs_index *idx, const char *path, u32 *first, u32 *last);
+ssize_t fs_index_read(const struct fs_index *idx, int fd, const struct fs_index_inode *inode,
+					  u64 off, void *buf, size_t len);
+
+#define fs_index_path_name(idx, p) ((idx)->strings + (p)->name_off)
+
+#endif /* FS_INDEX_H */
@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "fs-io.h"
+
+int fs_out_open(struct fs_out *o, const char *path)
+{
+	o->fd = -1;
+	o->path = path;
+	o->pos = 0;
+	if (snprintf(o->tmp, sizeof(o->tmp), "%s.tmp", path) >= (int)sizeof(o->tmp))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((o->fd = open(o->tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int fs_out_write(struct fs_out *o, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = write(o->fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+		o->pos += n;
+	}
+	return 0;
+}
+
+int fs_out_pad(struct fs_out *o)
+{
+	static const char zeros[8];
+	return fs_out_write(o, zeros, ALIGN8(o->pos) - o->pos);
+}
+
+int fs_out_section(struct fs_out *o, const void *buf, size_t len)
+{
+	if (fs_out_write(o, buf, len) < 0 || fs_out_pad(o) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int fs_out_commit(struct fs_out *o)
+{
+	if (fsync(o->fd) < 0)
+	{
+		fs_out_abort(o);
+		return -1;
+	}
+	int ret = close(o->fd);
+	o->fd = -1;
+	if (ret < 0 || rename(o->tmp, o->path) < 0)
+	{
+		fs_out_abort(o);
+		return -1;
+	}
+	return 0;
+}
+
+void fs_out_abort(struct fs_out *o)
+{
+	int err = errno;
+	if (o->fd >= 0)
+	{
+		close(o->fd);
+	}
+	o->fd = -1;
+	unlink(o->tmp);
+	errno = err;
+}
@@ -0,0 +1,33 @@
+#ifndef FS_IO_H
+#define FS_IO_H
+
+#include <stddef.h>
+#include "ext2-headers.h"
+#include "fs-image.h"
+
+#define ALIGN8(n) (((n) + 7) & ~(u64)7)
+
+/*
+	A file replaced atomically: written next to the target as <path>.tmp,
+	fsynced and renamed over it, so readers never see half a file. Writes
+	track the offset; sections are padded to 8 bytes so the records in the
+	next one stay aligned when the file is mapped.
+*/
+struct fs_out
+{
+	int fd;
+	const char *path;
+	char tmp[FS_PATH_MAX];
+	u64 pos;
+};
+
+int fs_out_open(struct fs_out *o, const char *path);
+int fs_out_write(struct fs_out *o, const void *buf, size_t len);
+/* zeros up to the next multiple of 8 */
+int fs_out_pad(struct fs_out *o);
+int fs_out_section(struct fs_out *o, const void *buf, size_t len);
+/* fsync, close and rename into place; on failure the temporary is removed */
+int fs_out_commit(struct fs_out *o);
+void fs_out_abort(struct fs_out *o);
+
+#endif /* FS_IO_H */
@@ -0,0 +1,402 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "ext2-headers.h"
+#include "fs-proto.h"
+
+/*
+	Load generator for `fs-explorer serve`: every connection keeps `depth`
+	requests in flight, topping the window up with one batched write and
+	timing each request from send to reply.
+*/
+
+#define MAX_PATHS 64
+#define HIST_SUB 16 /* buckets per power of two */
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct target
+{
+	const char *path;
+	u32 ino;
+	u16 mode;
+};
+
+struct options
+{
+	const char *socket;
+	const char *image;
+	const char *op;
+	int connections;
+	int depth;
+	double seconds;
+	struct target targets[MAX_PATHS];
+	int ntargets;
+};
+
+struct client
+{
+	pthread_t thread;
+	const struct options *opt;
+	int fd;
+	u16 image;
+	unsigned long long done;
+	unsigned long long errors;
+	u64 hist[HIST_BUCKETS];
+	int failed;
+};
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* log-linear histogram: HIST_SUB buckets between consecutive powers of two */
+static int hist_bucket(u64 v)
+{
+	if (v < HIST_SUB)
+		return v;
+	int log = 63 - __builtin_clzll(v);
+	int sub = (v >> (log - 4)) & (HIST_SUB - 1);
+	return (log - 3) * HIST_SUB + sub;
+}
+
+static u64 hist_value(int bucket)
+{
+	if (bucket < HIST_SUB)
+		return bucket;
+	int log = bucket / HIST_SUB + 3;
+	u64 sub = bucket % HIST_SUB;
+	return ((u64)HIST_SUB + sub) << (log - 4);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = read(fd, p, len);
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* one synchronous round trip, used for setup */
+static int call(int fd, struct fs_proto_req *req, const void *payload, void *reply, size_t reply_len)
+{
+	char buf[FS_PROTO_MAX_PAYLOAD];
+	struct fs_proto_resp resp;
+	if (write_all(fd, req, sizeof(*req)) < 0 || write_all(fd, payload, req->len) < 0 ||
+		read_all(fd, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+	if (resp.len > sizeof(buf) || read_all(fd, buf, resp.len) < 0)
+	{
+		errno = EPROTO;
+		return -1;
+	}
+	if (resp.status < 0)
+	{
+		errno = -resp.status;
+		return -1;
+	}
+	memcpy(reply, buf, resp.len < reply_len ? resp.len : reply_len);
+	return 0;
+}
+
+static int client_connect(struct client *c)
+{
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", c->opt->socket);
+	if ((c->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		perror(c->opt->socket);
+		return -1;
+	}
+
+	struct fs_proto_req req = {0};
+	struct fs_proto_open o;
+	req.op = FS_OP_OPEN;
+	req.len = strlen(c->opt->image);
+	if (call(c->fd, &req, c->opt->image, &o, sizeof(o)) < 0)
+	{
+		perror(c->opt->image);
+		return -1;
+	}
+	c->image = o.image;
+	return 0;
+}
+
+/* the i-th request of a connection, cycling over ops and targets */
+static size_t make_request(const struct client *c, u32 id, char *out)
+{
+	const struct options *opt = c->opt;
+	const struct target *t = &opt->targets[id % opt->ntargets];
+	struct fs_proto_req req = {0};
+	static const char *const mix[] = {"lookup", "stat", "readdir", "read"};
+	const char *op = strcmp(opt->op, "mix") ? opt->op : mix[(id / opt->ntargets) % 4];
+
+	req.id = id;
+	req.image = c->image;
+	req.ino = t->ino;
+	if (!strcmp(op, "lookup"))
+	{
+		req.op = FS_OP_LOOKUP;
+		req.len = strlen(t->path);
+	}
+	else if (!strcmp(op, "readdir") && (t->mode & 0xF000) == EXT2_S_IFDIR)
+	{
+		req.op = FS_OP_READDIR;
+		req.count = 4096;
+	}
+	else if (!strcmp(op, "read") && (t->mode & 0xF000) != EXT2_S_IFDIR)
+	{
+		req.op = FS_OP_READ;
+		req.count = 4096;
+	}
+	else
+	{
+		req.op = FS_OP_STAT;
+	}
+	memcpy(out, &req, sizeof(req));
+	memcpy(out + sizeof(req), t->path, req.len);
+	return sizeof(req) + req.len;
+}
+
+static void *client_main(void *arg)
+{
+	struct client *c = arg;
+	const struct options *opt = c->opt;
+	int depth = opt->depth;
+	u64 *sent = calloc(depth, sizeof(*sent));
+	char *batch = malloc((size_t)depth * (sizeof(struct fs_proto_req) + FS_PROTO_MAX_PAYLOAD));
+	char *data = malloc(FS_PROTO_MAX_READ);
+	if (sent == NULL || batch == NULL || data == NULL)
+	{
+		c->failed = 1;
+		goto out;
+	}
+
+	u64 end = now_ns() + (u64)(opt->seconds * 1e9);
+	u32 next_id = 0, next_reply = 0;
+	while (next_reply < next_id || now_ns() < end)
+	{
+		/* top the window up in a single write */
+		size_t len = 0;
+		u64 t = now_ns();
+		while (t < end && next_id - next_reply < (u32)depth)
+		{
+			sent[next_id % depth] = t;
+			len += make_request(c, next_id++, batch + len);
+		}
+		if (len > 0 && write_all(c->fd, batch, len) < 0)
+		{
+			c->failed = 1;
+			break;
+		}
+
+		/* then drain half the window so the next top-up is a real batch */
+		while (next_reply < next_id && (next_id - next_reply > (u32)depth / 2 || now_ns() >= end))
+		{
+			struct fs_proto_resp resp;
+			if (read_all(c->fd, &resp, sizeof(resp)) < 0 || resp.len > FS_PROTO_MAX_READ ||
+				read_all(c->fd, data, resp.len) < 0 || resp.id != next_reply)
+			{
+				c->failed = 1;
+				goto out;
+			}
+			c->hist[hist_bucket((now_ns() - sent[resp.id % depth]) / 1000)]++;
+			if (resp.status < 0)
+				c->errors++;
+			c->done++;
+			next_reply++;
+		}
+	}
+
+out:
+	free(sent);
+	free(batch);
+	free(data);
+	return NULL;
+}
+
+static u64 percentile(const u64 *hist, u64 total, double p)
+{
+	u64 want = total * p, seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += hist[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+			"usage: %s -s socket -i image [-c connections] [-d depth] [-t seconds]\n"
+			"          [-o lookup|stat|readdir|read|mix] [path...]\n",
+			prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct options opt = {NULL, NULL, "mix", 4, 16, 5.0, {{0}}, 0};
+	int ch;
+
+	while ((ch = getopt(argc, argv, "s:i:c:d:t:o:")) != -1)
+	{
+		switch (ch)
+		{
+		case 's':
+			opt.socket = optarg;
+			break;
+		case 'i':
+			opt.image = optarg;
+			break;
+		case 'c':
+			opt.connections = atoi(optarg);
+			break;
+		case 'd':
+			opt.depth = atoi(optarg);
+			break;
+		case 't':
+			opt.seconds = atof(optarg);
+			break;
+		case 'o':
+			opt.op = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opt.socket == NULL || opt.image == NULL || opt.connections < 1 || opt.depth < 1)
+	{
+		usage(argv[0]);
+	}
+	for (int i = optind; i < argc && opt.ntargets < MAX_PATHS; i++)
+	{
+		if (strlen(argv[i]) > FS_PROTO_MAX_PAYLOAD)
+			usage(argv[0]);
+		opt.targets[opt.ntargets++].path = argv[i];
+	}
+	if (opt.ntargets == 0)
+	{
+		opt.targets[opt.ntargets++].path = "/";
+	}
+
+	struct client *clients = calloc(opt.connections, sizeof(*clients));
+	if (clients == NULL)
+	{
+		errno_exit("calloc");
+	}
+	for (int i = 0; i < opt.connections; i++)
+	{
+		clients[i].opt = &opt;
+		if (client_connect(&clients[i]) < 0)
+		{
+			exit(1);
+		}
+	}
+
+	/* resolve the targets once so stat/readdir/read skip the lookup */
+	for (int i = 0; i < opt.ntargets; i++)
+	{
+		struct target *t = &opt.targets[i];
+		struct fs_proto_req req = {0};
+		struct fs_proto_stat st;
+		req.op = FS_OP_LOOKUP;
+		req.image = clients[0].image;
+		req.len = strlen(t->path);
+		if (call(clients[0].fd, &req, t->path, &t->ino, sizeof(t->ino)) < 0)
+		{
+			errno_exit(t->path);
+		}
+		req.op = FS_OP_STAT;
+		req.len = 0;
+		req.ino = t->ino;
+		if (call(clients[0].fd, &req, NULL, &st, sizeof(st)) < 0)
+		{
+			errno_exit(t->path);
+		}
+		t->mode = st.mode;
+	}
+
+	u64 start = now_ns();
+	for (int i = 0; i < opt.connections; i++)
+	{
+		if ((errno = pthread_create(&clients[i].thread, NULL, client_main, &clients[i])) != 0)
+		{
+			errno_exit("pthread_create");
+		}
+	}
+
+	static u64 hist[HIST_BUCKETS];
+	unsigned long long total = 0, errors = 0;
+	int failed = 0;
+	for (int i = 0; i < opt.connections; i++)
+	{
+		pthread_join(clients[i].thread, NULL);
+		for (int b = 0; b < HIST_BUCKETS; b++)
+			hist[b] += clients[i].hist[b];
+		total += clients[i].done;
+		errors += clients[i].errors;
+		failed |= clients[i].failed;
+		close(clients[i].fd);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+	free(clients);
+
+	printf("op %s, %d connections x depth %d, %.2f s\n"
+		   "requests     : %llu (%llu errors)\n"
+		   "throughput   : %.0f req/s\n"
+		   "latency p50  : %llu us\n"
+		   "latency p90  : %llu us\n"
+		   "latency p99  : %llu us\n"
+		   "latency p999 : %llu us\n",
+		   opt.op, opt.connections, opt.depth, elapsed, total, errors, total / elapsed,
+		   (unsigned long long)percentile(hist, total, 0.50),
+		   (unsigned long long)percentile(hist, total, 0.90),
+		   (unsigned long long)percentile(hist, total, 0.99),
+		   (unsigned long long)percentile(hist, total, 0.999));
+	return failed;
+}
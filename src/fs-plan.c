@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs-plan.h"
+
+struct plan_slot
+{
+	off_t off;
+	u32 index;
+};
+
+int fs_plan_init(struct fs_plan *p, const struct fs_image *img, u32 max_gap, u32 max_read)
+{
+	memset(p, 0, sizeof(*p));
+	p->img = img;
+	p->max_gap = max_gap;
+	p->max_read = max_read < img->block_size ? img->block_size : max_read;
+	if ((p->staging = malloc(p->max_read)) == NULL)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+void fs_plan_free(struct fs_plan *p)
+{
+	free(p->queue);
+	free(p->round);
+	free(p->order);
+	free(p->staging);
+	p->queue = p->round = NULL;
+	p->order = NULL;
+	p->staging = NULL;
+	p->count = 0;
+	p->cap = p->round_cap = p->order_cap = 0;
+}
+
+static int plan_push(struct fs_plan *p, off_t off, u32 len, void *buf, fs_plan_fn fn, void *ctx)
+{
+	if (array_grow(&p->queue, &p->cap, p->count + 1, sizeof(*p->queue)) < 0)
+	{
+		return -1;
+	}
+	p->queue[p->count++] = (struct fs_plan_req){off, len, buf, fn, ctx};
+	return 0;
+}
+
+int fs_plan_inode(struct fs_plan *p, u32 ino, struct ext2_inode *inode, fs_plan_fn fn, void *ctx)
+{
+	off_t off = fs_inode_offset(p->img, ino);
+	if (off < 0)
+	{
+		return -1;
+	}
+	return plan_push(p, off, sizeof(*inode), inode, fn, ctx);
+}
+
+int fs_plan_block(struct fs_plan *p, u32 block, void *buf, fs_plan_fn fn, void *ctx)
+{
+	if (block >= p->img->super.s_blocks_count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return plan_push(p, FIND_BLOCK_OFFSET(p->img, block), p->img->block_size, buf, fn, ctx);
+}
+
+static int by_offset(const void *a, const void *b)
+{
+	const struct plan_slot *x = a, *y = b;
+	if (x->off != y->off)
+		return x->off < y->off ? -1 : 1;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/* read everything in the current round, sorted and merged */
+static int plan_sweep(struct fs_plan *p, u32 n)
+{
+	struct plan_slot *slots = p->order;
+	for (u32 i = 0; i < n; i++)
+	{
+		slots[i] = (struct plan_slot){p->round[i].off, i};
+	}
+	qsort(slots, n, sizeof(*slots), by_offset);
+
+	for (u32 i = 0; i < n;)
+	{
+		off_t start = slots[i].off;
+		off_t end = start + p->round[slots[i].index].len;
+		u32 j = i + 1;
+		for (; j < n; j++)
+		{
+			off_t next_end = slots[j].off + p->round[slots[j].index].len;
+			if (slots[j].off > end + p->max_gap || (next_end > end ? next_end : end) - start > p->max_read)
+				break;
+			if (next_end > end)
+				end = next_end;
+		}
+
+		if (fs_read_raw(p->img, start, end - start, p->staging) < 0)
+		{
+			return -1;
+		}
+		for (; i < j; i++)
+		{
+			const struct fs_plan_req *req = &p->round[slots[i].index];
+			memcpy(req->buf, p->staging + (req->off - start), req->len);
+		}
+		p->reads++;
+		p->bytes += end - start;
+	}
+	return 0;
+}
+
+int fs_plan_run(struct fs_plan *p)
+{
+	while (p->count > 0)
+	{
+		/* callbacks queue into the emptied queue while this round is served */
+		struct fs_plan_req *round = p->queue;
+		size_t round_cap = p->cap;
+		u32 n = p->count;
+		p->queue = p->round;
+		p->cap = p->round_cap;
+		p->count = 0;
+		p->round = round;
+		p->round_cap = round_cap;
+
+		if (array_grow(&p->order, &p->order_cap, round_cap, sizeof(*p->order)) < 0)
+		{
+			return -1;
+		}
+		if (plan_sweep(p, n) < 0)
+		{
+			return -1;
+		}
+		p->requests += n;
+
+		for (u32 i = 0; i < n; i++)
+		{
+			int ret = p->round[i].fn(p->round[i].ctx, p->round[i].buf);
+			if (ret != 0)
+			{
+				p->count = 0;
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+/* the planned walk */
+
+struct walk_node
+{
+	struct walk_node *parent; /* NULL for the directory the walk starts at */
+	struct plan_walk *w;
+	const char *name; /* the path given for the start, in block until the inode is read */
+	u32 name_len;
+	u32 ino;
+	int depth;
+	struct walk_dblock *block;
+	struct ext2_inode inode;
+};
+
+struct walk_dblock
+{
+	struct walk_node *dir;
+	u32 refs; /* entries still naming into buf */
+	unsigned char buf[];
+};
+
+struct plan_walk
+{
+	const struct fs_image *img;
+	struct fs_plan *plan;
+	struct arena *scratch;
+	struct slab nodes;
+	struct slab dblocks;
+	fs_walk_fn fn;
+	void *ctx;
+	char *path;
+	int max_depth;
+};
+
+/* the path of node, assembled by following the parents */
+static ssize_t walk_path(struct plan_walk *w, const struct walk_node *node)
+{
+	size_t len = 0;
+	const struct walk_node *n;
+	for (n = node; n->parent; n = n->parent)
+	{
+		len += 1 + n->name_len;
+	}
+	size_t prefix = n->name_len;
+	if (prefix > 0 && n->name[prefix - 1] == '/')
+	{
+		prefix--;
+	}
+	if (prefix + len + 1 > FS_PATH_MAX)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	size_t end = prefix + len;
+	w->path[end] = '\0';
+	for (n = node; n->parent; n = n->parent)
+	{
+		end -= n->name_len;
+		memcpy(w->path + end, n->name, n->name_len);
+		w->path[--end] = '/';
+	}
+	memcpy(w->path, n->name, prefix);
+	return prefix + len;
+}
+
+static int walk_block_done(void *ctx, void *buf);
+
+static void walk_block_put(struct plan_walk *w, struct walk_dblock *db)
+{
+	if (db && --db->refs == 0)
+	{
+		slab_free(&w->dblocks, db);
+	}
+}
+
+static int walk_queue_dir(struct plan_walk *w, struct walk_node *dir)
+{
+	u32 bs = w->img->block_size;
+	u32 nblocks = (dir->inode.i_size + bs - 1) / bs;
+	for (u32 lblock = 0; lblock < nblocks; lblock++)
+	{
+		u32 block;
+		if (fs_block_map(w->img, &dir->inode, lblock, &block) < 0)
+		{
+			return -1;
+		}
+		if (block == 0)
+		{
+			continue;
+		}
+		struct walk_dblock *db = slab_alloc(&w->dblocks);
+		if (db == NULL)
+		{
+			return -1;
+		}
+		db->dir = dir;
+		if (fs_plan_block(w->plan, block, db->buf, walk_block_done, db) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int walk_inode_done(void *ctx, void *buf)
+{
+	struct walk_node *node = ctx;
+	struct plan_walk *w = node->w;
+	(void)buf;
+
+	ssize_t len = walk_path(w, node);
+	if (len < 0)
+	{
+		return -1;
+	}
+	int ret = w->fn(w->ctx, w->path, len, node->ino, &node->inode);
+	if (ret == 0 && fs_is_dir(&node->inode) && (w->max_depth < 0 || node->depth < w->max_depth))
+	{
+		/* kept: its children point at it, so the name moves out of the block */
+		if ((node->name = arena_strndup(w->scratch, node->name, node->name_len)) == NULL)
+		{
+			return -1;
+		}
+		walk_block_put(w, node->block);
+		node->block = NULL;
+		return walk_queue_dir(w, node);
+	}
+	walk_block_put(w, node->block);
+	slab_free(&w->nodes, node);
+	return ret;
+}
+
+static int walk_entry(void *ctx, u32 ino, const char *name, size_t name_len)
+{
+	struct walk_dblock *db = ctx;
+	struct plan_walk *w = db->dir->w;
+	if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.'))
+	{
+		return 0;
+	}
+
+	struct walk_node *node = slab_alloc(&w->nodes);
+	if (node == NULL)
+	{
+		return -1;
+	}
+	node->parent = db->dir;
+	node->w = w;
+	node->name = name;
+	node->name_len = name_len;
+	node->block = db;
+	db->refs++;
+	node->ino = ino;
+	node->depth = db->dir->depth + 1;
+	return fs_plan_inode(w->plan, ino, &node->inode, walk_inode_done, node);
+}
+
+static int walk_block_done(void *ctx, void *buf)
+{
+	struct walk_dblock *db = ctx;
+	struct plan_walk *w = db->dir->w;
+	db->refs = 1; /* held while its entries are queued */
+	int ret = fs_dir_block(w->img, buf, walk_entry, db);
+	walk_block_put(w, db);
+	return ret;
+}
+
+/*
+	Memory is a node and a name per directory expanded so far (children
+	name their parent instead of copying the path), and the entries and
+	blocks of the level in flight. An entry's name points into its
+	directory block, which is freed once the last of its inodes is read.
+*/
+int fs_walk_planned(const struct fs_image *img, const char *path, int max_depth, struct arena *scratch,
+					struct fs_plan *p, fs_walk_fn fn, void *ctx)
+{
+	struct plan_walk w = {0};
+	struct arena_mark mark = arena_mark(scratch);
+	struct walk_node *start;
+	int ret = -1;
+
+	w.img = img;
+	w.plan = p;
+	w.scratch = scratch;
+	w.fn = fn;
+	w.ctx = ctx;
+	w.max_depth = max_depth;
+	slab_init(&w.nodes, scratch, sizeof(struct walk_node));
+	slab_init(&w.dblocks, scratch, sizeof(struct walk_dblock) + img->block_size);
+
+	if ((w.path = arena_alloc(scratch, FS_PATH_MAX)) == NULL || (start = slab_alloc(&w.nodes)) == NULL ||
+		fs_lookup(img, path, scratch, &start->ino) < 0 || fs_read_inode(img, start->ino, &start->inode) < 0)
+	{
+		goto out;
+	}
+	start->parent = NULL;
+	start->block = NULL;
+	start->w = &w;
+	start->name = path;
+	start->name_len = strlen(path);
+	start->depth = 0;
+	if (start->name_len >= FS_PATH_MAX)
+	{
+		errno = ENAMETOOLONG;
+		goto out;
+	}
+	if (!fs_is_dir(&start->inode))
+	{
+		errno = ENOTDIR;
+		goto out;
+	}
+
+	if (max_depth != 0 && walk_queue_dir(&w, start) < 0)
+	{
+		goto out;
+	}
+	ret = fs_plan_run(p);
+
+out:
+	p->count = 0;
+	arena_rewind(scratch, mark);
+	return ret < 0 ? -1 : ret;
+}
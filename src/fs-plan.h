@@ -0,0 +1,64 @@
+#ifndef FS_PLAN_H
+#define FS_PLAN_H
+
+#include "fs-image.h"
+
+/*
+	Read planner for batch operations. Callers queue inode and block reads
+	with a destination buffer and a callback; fs_plan_run() sorts what is
+	queued by physical offset, merges neighbours (at most max_gap bytes
+	apart, at most max_read bytes per read) into one pread each, copies the
+	pieces out and then calls the callbacks in the order they were queued.
+	Callbacks may queue more reads, which make up the next round.
+*/
+
+#define FS_PLAN_MAX_GAP (64 * 1024)
+#define FS_PLAN_MAX_READ (1024 * 1024)
+
+/* return 0 to keep going, non-zero stops the plan and is returned by fs_plan_run() */
+typedef int (*fs_plan_fn)(void *ctx, void *buf);
+
+struct fs_plan_req
+{
+	off_t off;
+	u32 len;
+	void *buf;
+	fs_plan_fn fn;
+	void *ctx;
+};
+
+struct plan_slot;
+
+struct fs_plan
+{
+	const struct fs_image *img;
+	struct fs_plan_req *queue; /* filled by fs_plan_inode/block */
+	u32 count;
+	size_t cap;
+	struct fs_plan_req *round; /* being served */
+	size_t round_cap;
+	struct plan_slot *order; /* round sorted by offset */
+	size_t order_cap;
+	unsigned char *staging;
+	u32 max_gap;
+	u32 max_read;
+	u64 requests; /* totals, for reporting */
+	u64 reads;
+	u64 bytes;
+};
+
+int fs_plan_init(struct fs_plan *p, const struct fs_image *img, u32 max_gap, u32 max_read);
+void fs_plan_free(struct fs_plan *p);
+int fs_plan_inode(struct fs_plan *p, u32 ino, struct ext2_inode *inode, fs_plan_fn fn, void *ctx);
+int fs_plan_block(struct fs_plan *p, u32 block, void *buf, fs_plan_fn fn, void *ctx);
+int fs_plan_run(struct fs_plan *p);
+
+/*
+	fs_walk() with every level's directory blocks and inodes read through
+	a plan: entries come out breadth first rather than depth first, and
+	the reads of a level sweep the image in offset order.
+*/
+int fs_walk_planned(const struct fs_image *img, const char *path, int max_depth, struct arena *scratch,
+					struct fs_plan *p, fs_walk_fn fn, void *ctx);
+
+#endif /* FS_PLAN_H */
@@ -0,0 +1,93 @@
+#ifndef FS_PROTO_H
+#define FS_PROTO_H
+
+#include "ext2-headers.h"
+
+/*
+	Wire format of `fs-explorer serve`, host byte order (the socket is
+	local). A request is a fixed header followed by len payload bytes; the
+	reply echoes id so clients can pipeline any number of requests on one
+	connection. Replies on a connection come back in request order.
+
+	FS_OP_OPEN     payload: image path       reply: struct fs_proto_open
+	FS_OP_LOOKUP   payload: path             reply: u32 inode
+	FS_OP_STAT     ino                       reply: struct fs_proto_stat
+	FS_OP_READDIR  ino, off = cookie,        reply: struct fs_proto_readdir +
+				   count = max bytes                entries
+	FS_OP_READ     ino, off, count           reply: data (short at EOF)
+
+	status is 0 or a negative errno; failed replies carry no payload.
+*/
+
+#define FS_PROTO_MAX_PAYLOAD 4096
+#define FS_PROTO_MAX_READ (1024 * 1024)
+#define FS_PROTO_DIR_END UINT64_MAX
+
+enum fs_proto_op
+{
+	FS_OP_OPEN = 1,
+	FS_OP_LOOKUP,
+	FS_OP_STAT,
+	FS_OP_READDIR,
+	FS_OP_READ,
+};
+
+struct fs_proto_req
+{
+	u32 len;
+	u32 id;
+	u16 op;
+	u16 image; /* handle from FS_OP_OPEN */
+	u32 ino;
+	u64 off;
+	u32 count;
+	u32 pad;
+};
+
+struct fs_proto_resp
+{
+	u32 len;
+	u32 id;
+	i32 status;
+	u32 pad;
+};
+
+struct fs_proto_open
+{
+	u16 image;
+	u16 pad;
+	u32 block_size;
+	u32 blocks_count;
+	u32 inodes_count;
+};
+
+struct fs_proto_stat
+{
+	u32 ino;
+	u16 mode;
+	u16 links_count;
+	u32 uid;
+	u32 gid;
+	u64 size;
+	u32 atime;
+	u32 ctime;
+	u32 mtime;
+	u32 blocks;
+};
+
+struct fs_proto_readdir
+{
+	u64 next; /* cookie for the next call, FS_PROTO_DIR_END when done */
+	u32 count;
+	u32 pad;
+};
+
+/* followed by name_len bytes, rec_len rounds the whole entry up to 4 */
+struct fs_proto_dirent
+{
+	u32 ino;
+	u16 rec_len;
+	u16 name_len;
+};
+
+#endif /* FS_PROTO_H */
@@ -0,0 +1,576 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "fs-arena.h"
+#include "fs-image.h"
+#include "fs-proto.h"
+#include "fs-serve.h"
+
+#define CONN_IN_MAX (256 * 1024)		 /* stop reading while this much is unparsed */
+#define CONN_OUT_MAX (4 * 1024 * 1024) /* stop parsing while this much is unsent */
+
+/* CONN_OUT_MAX unless FS_SERVE_OUT_MAX is set; tests shrink it to hit the pause */
+static size_t conn_out_max = CONN_OUT_MAX;
+
+/*
+	Images stay open for the life of the server. A handle is the slot
+	index; slots are filled under the lock and published by bumping count,
+	after which the fs_image is only ever read (pread is thread safe).
+*/
+struct served_image
+{
+	char path[FS_PATH_MAX];
+	struct fs_image img;
+	struct arena arena;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct served_image images[SERVE_MAX_IMAGES];
+	atomic_uint count;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* a connection is handled by one worker at a time (EPOLLONESHOT) */
+struct conn
+{
+	int fd;
+	char *in;
+	size_t in_len, in_cap;
+	char *out;
+	size_t out_len, out_off, out_cap;
+};
+
+struct worker
+{
+	pthread_t thread;
+	int epfd;
+	int lfd;
+	struct arena scratch;
+	unsigned long long requests;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int cache_open(const char *path, u16 *handle)
+{
+	int ret = 0;
+	pthread_mutex_lock(&cache.lock);
+	unsigned count = atomic_load(&cache.count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		if (!strcmp(cache.images[i].path, path))
+		{
+			*handle = i;
+			goto out;
+		}
+	}
+	if (count == SERVE_MAX_IMAGES)
+	{
+		errno = EMFILE;
+		ret = -1;
+		goto out;
+	}
+
+	struct served_image *s = &cache.images[count];
+	snprintf(s->path, sizeof(s->path), "%s", path);
+	arena_init(&s->arena, 4096);
+	if (fs_open(&s->img, s->path, &s->arena) < 0)
+	{
+		int err = errno;
+		arena_free(&s->arena);
+		errno = err;
+		ret = -1;
+		goto out;
+	}
+	*handle = count;
+	atomic_store(&cache.count, count + 1);
+
+out:
+	pthread_mutex_unlock(&cache.lock);
+	return ret;
+}
+
+static const struct fs_image *cache_get(u16 handle)
+{
+	if (handle >= atomic_load(&cache.count))
+	{
+		errno = EBADF;
+		return NULL;
+	}
+	return &cache.images[handle].img;
+}
+
+/* room for a reply header plus max payload bytes at the end of out */
+static struct fs_proto_resp *reply_begin(struct conn *c, u32 id, size_t max)
+{
+	/* drop what was sent so out holds at most conn_out_max plus one reply */
+	if (c->out_off > 0)
+	{
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+	}
+	if (array_grow(&c->out, &c->out_cap, c->out_len + sizeof(struct fs_proto_resp) + max, 1) < 0)
+	{
+		return NULL;
+	}
+	struct fs_proto_resp *resp = (struct fs_proto_resp *)(c->out + c->out_len);
+	memset(resp, 0, sizeof(*resp));
+	resp->id = id;
+	return resp;
+}
+
+static void reply_end(struct conn *c, struct fs_proto_resp *resp, int status, size_t len)
+{
+	resp->status = status;
+	resp->len = status < 0 ? 0 : len;
+	c->out_len += sizeof(*resp) + resp->len;
+}
+
+struct readdir_ctx
+{
+	char *buf;
+	size_t len, cap;
+	u32 count;
+};
+
+static int readdir_entry(void *ctx, u32 ino, const char *name, size_t name_len)
+{
+	struct readdir_ctx *r = ctx;
+	size_t rec_len = (sizeof(struct fs_proto_dirent) + name_len + 3) & ~(size_t)3;
+	if (r->len + rec_len > r->cap)
+	{
+		return 1; /* full, resume here next time */
+	}
+	struct fs_proto_dirent *d = (struct fs_proto_dirent *)(r->buf + r->len);
+	d->ino = ino;
+	d->rec_len = rec_len;
+	d->name_len = name_len;
+	memcpy(d + 1, name, name_len);
+	memset((char *)(d + 1) + name_len, 0, rec_len - sizeof(*d) - name_len);
+	r->len += rec_len;
+	r->count++;
+	return 0;
+}
+
+static int do_request(struct worker *w, struct conn *c, const struct fs_proto_req *req, const char *payload)
+{
+	char path[FS_PATH_MAX];
+	const struct fs_image *img = NULL;
+	struct ext2_inode inode;
+	size_t max = 0;
+
+	switch (req->op)
+	{
+	case FS_OP_OPEN:
+		max = sizeof(struct fs_proto_open);
+		break;
+	case FS_OP_LOOKUP:
+		max = sizeof(u32);
+		break;
+	case FS_OP_STAT:
+		max = sizeof(struct fs_proto_stat);
+		break;
+	case FS_OP_READDIR:
+		max = sizeof(struct fs_proto_readdir) + (req->count < FS_PROTO_MAX_READ ? req->count : FS_PROTO_MAX_READ);
+		break;
+	case FS_OP_READ:
+		max = req->count < FS_PROTO_MAX_READ ? req->count : FS_PROTO_MAX_READ;
+		break;
+	}
+
+	struct fs_proto_resp *resp = reply_begin(c, req->id, max);
+	if (resp == NULL)
+	{
+		return -1;
+	}
+	char *out = (char *)(resp + 1);
+	size_t len = 0;
+	int ret = -1;
+
+	if (req->op == FS_OP_OPEN || req->op == FS_OP_LOOKUP)
+	{
+		if (req->len == 0 || req->len >= sizeof(path))
+		{
+			errno = EINVAL;
+			goto done;
+		}
+		memcpy(path, payload, req->len);
+		path[req->len] = '\0';
+	}
+	if (req->op != FS_OP_OPEN && (img = cache_get(req->image)) == NULL)
+	{
+		goto done;
+	}
+	if ((req->op == FS_OP_STAT || req->op == FS_OP_READDIR || req->op == FS_OP_READ) &&
+		fs_read_inode(img, req->ino, &inode) < 0)
+	{
+		goto done;
+	}
+
+	switch (req->op)
+	{
+	case FS_OP_OPEN:
+	{
+		struct fs_proto_open o = {0};
+		if (cache_open(path, &o.image) < 0)
+			goto done;
+		img = cache_get(o.image);
+		o.block_size = img->block_size;
+		o.blocks_count = img->super.s_blocks_count;
+		o.inodes_count = img->super.s_inodes_count;
+		memcpy(out, &o, sizeof(o));
+		len = sizeof(o);
+		break;
+	}
+	case FS_OP_LOOKUP:
+	{
+		u32 ino;
+		if (fs_lookup(img, path, &w->scratch, &ino) < 0)
+			goto done;
+		memcpy(out, &ino, sizeof(ino));
+		len = sizeof(ino);
+		break;
+	}
+	case FS_OP_STAT:
+	{
+		struct fs_proto_stat st = {req->ino, inode.i_mode, inode.i_links_count, inode.i_uid, inode.i_gid,
+								   fs_inode_size(&inode), inode.i_atime, inode.i_ctime, inode.i_mtime, inode.i_blocks};
+		memcpy(out, &st, sizeof(st));
+		len = sizeof(st);
+		break;
+	}
+	case FS_OP_READDIR:
+	{
+		struct fs_proto_readdir hdr = {FS_PROTO_DIR_END, 0, 0};
+		struct readdir_ctx r = {out + sizeof(hdr), 0, max - sizeof(hdr), 0};
+		u64 pos = req->off;
+		if (pos != FS_PROTO_DIR_END)
+		{
+			int n = fs_dir_iterate_at(img, &inode, &w->scratch, &pos, readdir_entry, &r);
+			if (n < 0)
+				goto done;
+			if (n > 0 && r.count == 0)
+			{
+				errno = EOVERFLOW; /* count too small for the next entry */
+				goto done;
+			}
+			hdr.next = n > 0 ? pos : FS_PROTO_DIR_END;
+			hdr.count = r.count;
+		}
+		memcpy(out, &hdr, sizeof(hdr));
+		len = sizeof(hdr) + r.len;
+		break;
+	}
+	case FS_OP_READ:
+	{
+		if (fs_is_dir(&inode))
+		{
+			errno = EISDIR;
+			goto done;
+		}
+		ssize_t n = fs_read(img, &inode, req->off, out, max);
+		if (n < 0)
+			goto done;
+		len = n;
+		break;
+	}
+	default:
+		errno = ENOSYS;
+		goto done;
+	}
+	ret = 0;
+
+done:
+	reply_end(c, resp, ret < 0 ? -errno : 0, len);
+	w->requests++;
+	return 0;
+}
+
+static void conn_close(struct worker *w, struct conn *c)
+{
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+/* a whole request is buffered */
+static int conn_has_frame(const struct conn *c)
+{
+	struct fs_proto_req req;
+	if (c->in_len < sizeof(req))
+	{
+		return 0;
+	}
+	memcpy(&req, c->in, sizeof(req));
+	return req.len > FS_PROTO_MAX_PAYLOAD || c->in_len >= sizeof(req) + req.len;
+}
+
+/* everything that arrived in one wakeup is handled as one batch */
+static void conn_handle(struct worker *w, struct conn *c, u32 events)
+{
+	int broken = (events & (EPOLLERR | EPOLLHUP)) != 0;
+	int peer_done = 0; /* read side closed, finish sending replies */
+
+	while (!broken && c->in_len < CONN_IN_MAX)
+	{
+		if (array_grow(&c->in, &c->in_cap, c->in_len + 16384, 1) < 0)
+		{
+			broken = 1;
+			break;
+		}
+		ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+		if (n > 0)
+		{
+			c->in_len += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0)
+			peer_done = 1;
+		else if (errno != EAGAIN)
+			broken = 1;
+		break;
+	}
+
+	/*
+		Parsing pauses once conn_out_max is queued. If the replies then go
+		out in full, nothing wakes us for frames already buffered, so carry
+		on with those here.
+	*/
+	do
+	{
+		size_t used = 0;
+		while (!broken && c->out_len - c->out_off < conn_out_max && c->in_len - used >= sizeof(struct fs_proto_req))
+		{
+			struct fs_proto_req req;
+			memcpy(&req, c->in + used, sizeof(req));
+			if (req.len > FS_PROTO_MAX_PAYLOAD)
+			{
+				broken = 1; /* not speaking our protocol */
+				break;
+			}
+			if (c->in_len - used < sizeof(req) + req.len)
+			{
+				break;
+			}
+			arena_reset(&w->scratch);
+			if (do_request(w, c, &req, c->in + used + sizeof(req)) < 0)
+			{
+				broken = 1;
+				break;
+			}
+			used += sizeof(req) + req.len;
+		}
+		memmove(c->in, c->in + used, c->in_len - used);
+		c->in_len -= used;
+
+		while (!broken && c->out_off < c->out_len)
+		{
+			ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN)
+					broken = 1;
+				break;
+			}
+			c->out_off += n;
+		}
+		if (c->out_off == c->out_len)
+		{
+			c->out_off = c->out_len = 0;
+		}
+	} while (!broken && c->out_len == 0 && conn_has_frame(c));
+
+	if (broken || (peer_done && c->out_len == 0))
+	{
+		conn_close(w, c);
+		return;
+	}
+
+	struct epoll_event ev = {EPOLLONESHOT, {.ptr = c}};
+	if (!peer_done && c->in_len < CONN_IN_MAX)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (c->out_len > 0)
+		ev.events |= EPOLLOUT;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+	{
+		conn_close(w, c);
+	}
+}
+
+static void accept_all(struct worker *w)
+{
+	for (;;)
+	{
+		int fd = accept(w->lfd, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			return;
+		}
+		struct conn *c = calloc(1, sizeof(*c));
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		if (c == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		struct epoll_event ev = {EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, {.ptr = c}};
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			perror("epoll_ctl");
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event events[32];
+
+	while (!stop)
+	{
+		int n = epoll_wait(w->epfd, events, 32, 200);
+		if (n < 0 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			break;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == NULL)
+				accept_all(w);
+			else
+				conn_handle(w, events[i].data.ptr, events[i].events);
+		}
+	}
+	return NULL;
+}
+
+int fs_serve(const char *socket_path, int workers, char **images, int nimages)
+{
+	struct sockaddr_un addr = {0};
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	const char *out_max = getenv("FS_SERVE_OUT_MAX");
+	if (out_max && strtoul(out_max, NULL, 0) > 0)
+	{
+		conn_out_max = strtoul(out_max, NULL, 0);
+	}
+	for (int i = 0; i < nimages; i++)
+	{
+		u16 handle;
+		if (cache_open(images[i], &handle) < 0)
+		{
+			perror(images[i]);
+			return -1;
+		}
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0)
+	{
+		return -1;
+	}
+	unlink(socket_path);
+	mode_t mask = umask(077);
+	int bound = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (bound < 0 || listen(lfd, SOMAXCONN) < 0 || fcntl(lfd, F_SETFL, O_NONBLOCK) < 0)
+	{
+		close(lfd);
+		return -1;
+	}
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+	if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) < 0)
+	{
+		close(lfd);
+		return -1;
+	}
+
+	struct sigaction sa = {0};
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (workers < 1)
+		workers = 1;
+	struct worker *pool = calloc(workers, sizeof(*pool));
+	if (pool == NULL)
+	{
+		close(lfd);
+		close(epfd);
+		return -1;
+	}
+	fprintf(stderr, "serving on %s with %d workers\n", socket_path, workers);
+	int started = 0;
+	for (; started < workers; started++)
+	{
+		struct worker *w = &pool[started];
+		w->epfd = epfd;
+		w->lfd = lfd;
+		arena_init(&w->scratch, ARENA_DEFAULT_CHUNK);
+		if ((errno = pthread_create(&w->thread, NULL, worker_main, w)) != 0)
+		{
+			perror("pthread_create");
+			stop = 1;
+			break;
+		}
+	}
+
+	unsigned long long total = 0;
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(pool[i].thread, NULL);
+		total += pool[i].requests;
+		arena_free(&pool[i].scratch);
+	}
+	free(pool);
+	fprintf(stderr, "served %llu requests\n", total);
+
+	/* connections still registered are dropped with the process */
+	close(epfd);
+	close(lfd);
+	unlink(socket_path);
+	for (unsigned i = 0; i < atomic_load(&cache.count); i++)
+	{
+		fs_close(&cache.images[i].img);
+		arena_free(&cache.images[i].arena);
+	}
+	return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef FS_SERVE_H
+#define FS_SERVE_H
+
+#define SERVE_MAX_IMAGES 64
+
+/* runs until SIGINT/SIGTERM; images are opened up front, others on demand */
+int fs_serve(const char *socket_path, int workers, char **images, int nimages);
+
+#endif /* FS_SERVE_H */
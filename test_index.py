@@ -0,0 +1,73 @@
+import os
+import pathlib
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+BIG_SIZE = 4 * 1024 ** 3 + 100
+# fields the sidecar keeps; it has extents instead of block 0/1
+STAT_FIELDS = ('inode', 'imode', 'uid', 'size', 'gid', 'link count', 'blocks', 'flags')
+
+class IndexTestCase(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        base_dir = pathlib.Path(__file__).resolve().parent
+        build_dir = base_dir.joinpath('build')
+        shutil.rmtree(build_dir, ignore_errors=True)
+        subprocess.run(['meson', 'setup', 'build'],
+                       check=True, cwd=base_dir, stdout=subprocess.DEVNULL)
+        subprocess.run(['meson', 'compile', '-C', 'build'],
+                       check=True, cwd=base_dir, stdout=subprocess.DEVNULL)
+        cls.explorer = str(build_dir.joinpath('fs-explorer'))
+        cls.tmp = tempfile.mkdtemp()
+        tree = os.path.join(cls.tmp, 'tree')
+        os.makedirs(os.path.join(tree, 'dir', 'sub'))
+        with open(os.path.join(tree, 'dir', 'small'), 'wb') as f:
+            f.write(b'small file\n' * 1000)
+        os.symlink('dir/small', os.path.join(tree, 'link'))
+        # sparse, with its only data block past 4 GiB
+        with open(os.path.join(tree, 'big'), 'wb') as f:
+            f.truncate(BIG_SIZE)
+            f.seek(BIG_SIZE - 100)
+            f.write(b'tail' * 25)
+        cls.paths = ['/', '/dir', '/dir/sub', '/dir/small', '/link', '/big']
+        cls.image = os.path.join(cls.tmp, 'index.img')
+        subprocess.run(['mke2fs', '-q', '-F', '-t', 'ext2', '-b', '4096', '-d', tree, cls.image, '64M'],
+                       check=True, stdout=subprocess.DEVNULL)
+        cls.index = os.path.join(cls.tmp, 'index.idx')
+        subprocess.run([cls.explorer, '-i', cls.image, 'index', cls.index],
+                       check=True, stderr=subprocess.DEVNULL)
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.tmp, ignore_errors=True)
+
+    def _run(self, *args):
+        return subprocess.run([self.explorer, '-i', self.image, *args],
+                              check=True, stdout=subprocess.PIPE).stdout
+
+    def _stat(self, *args):
+        fields = {}
+        for line in self._run(*args).decode().splitlines():
+            key, _, value = line.partition(':')
+            if key.strip() in STAT_FIELDS:
+                fields[key.strip()] = value.strip()
+        return fields
+
+    def test_stat_matches_live(self):
+        for path in self.paths:
+            with self.subTest(path=path):
+                self.assertEqual(self._stat('-x', self.index, 'stat', path), self._stat('stat', path))
+
+    def test_large_file_size(self):
+        self.assertEqual(self._stat('-x', self.index, 'stat', '/big')['size'], str(BIG_SIZE))
+
+    def test_cat_matches_live(self):
+        for path in ('/dir/small', '/link'):
+            with self.subTest(path=path):
+                self.assertEqual(self._run('-x', self.index, 'cat', path), self._run('cat', path))
+
+if __name__ == '__main__':
+    unittest.main()
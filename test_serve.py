@@ -0,0 +1,113 @@
+import os
+import pathlib
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+import unittest
+
+REQ = struct.Struct('<IIHHIQII')
+RESP = struct.Struct('<IIiI')
+FS_OP_LOOKUP = 2
+FS_OP_READ = 5
+MAX_READ = 1024 * 1024
+# reply bytes the server queues per connection before it pauses parsing
+OUT_MAX = 16 * 1024
+
+class ServeTestCase(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        base_dir = pathlib.Path(__file__).resolve().parent
+        build_dir = base_dir.joinpath('build')
+        shutil.rmtree(build_dir, ignore_errors=True)
+        subprocess.run(['meson', 'setup', 'build'],
+                       check=True, cwd=base_dir, stdout=subprocess.DEVNULL)
+        subprocess.run(['meson', 'compile', '-C', 'build'],
+                       check=True, cwd=base_dir, stdout=subprocess.DEVNULL)
+        cls.tmp = tempfile.mkdtemp()
+        tree = os.path.join(cls.tmp, 'tree')
+        os.mkdir(tree)
+        cls.data = bytes(i * 7 % 251 for i in range(2 * MAX_READ))
+        with open(os.path.join(tree, 'big'), 'wb') as f:
+            f.write(cls.data)
+        image = os.path.join(cls.tmp, 'serve.img')
+        subprocess.run(['mke2fs', '-q', '-F', '-t', 'ext2', '-b', '1024', '-d', tree, image, '8M'],
+                       check=True, stdout=subprocess.DEVNULL)
+        cls.sock = os.path.join(cls.tmp, 'sock')
+        env = dict(os.environ, FS_SERVE_OUT_MAX=str(OUT_MAX))
+        cls.server = subprocess.Popen([str(build_dir.joinpath('fs-explorer')), '-j', '2',
+                                       'serve', cls.sock, image], env=env, stderr=subprocess.DEVNULL)
+        for _ in range(100):
+            if os.path.exists(cls.sock):
+                break
+            time.sleep(0.05)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.server.terminate()
+        cls.server.wait()
+        shutil.rmtree(cls.tmp, ignore_errors=True)
+
+    def _connect(self):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.settimeout(10)
+        s.connect(self.sock)
+        return s
+
+    def _recv(self, s, n):
+        buf = bytearray()
+        while len(buf) < n:
+            chunk = s.recv(n - len(buf))
+            if not chunk:
+                self.fail('server closed the connection')
+            buf += chunk
+        return bytes(buf)
+
+    def _reply(self, s):
+        length, rid, status, _ = RESP.unpack(self._recv(s, RESP.size))
+        return rid, status, self._recv(s, length)
+
+    def _lookup(self, s, path):
+        payload = path.encode()
+        s.sendall(REQ.pack(len(payload), 0, FS_OP_LOOKUP, 0, 0, 0, 0, 0) + payload)
+        _, status, data = self._reply(s)
+        self.assertEqual(status, 0)
+        return struct.unpack('<I', data)[0]
+
+    def test_pipelined_reads(self):
+        # replies larger than the queue limit, sent while the client reads
+        s = self._connect()
+        ino = self._lookup(s, '/big')
+        count = 40
+        replies = []
+        reader = threading.Thread(target=lambda: replies.extend(self._reply(s) for _ in range(count)))
+        reader.start()
+        s.sendall(b''.join(REQ.pack(0, i, FS_OP_READ, 0, ino, i % 2 * MAX_READ, MAX_READ, 0)
+                           for i in range(count)))
+        reader.join()
+        self.assertEqual(len(replies), count)
+        for i, (rid, status, data) in enumerate(replies):
+            self.assertEqual((rid, status), (i, 0))
+            self.assertEqual(data, self.data[i % 2 * MAX_READ:][:MAX_READ])
+        s.close()
+
+    def test_frames_buffered_past_pause(self):
+        # all requests arrive in one wakeup; the paused replies fit in the socket
+        # buffer, so nothing but the server itself resumes parsing the rest
+        s = self._connect()
+        ino = self._lookup(s, '/big')
+        count, size = 64, 4096
+        s.sendall(b''.join(REQ.pack(0, i, FS_OP_READ, 0, ino, i * size, size, 0)
+                           for i in range(count)))
+        for i in range(count):
+            rid, status, data = self._reply(s)
+            self.assertEqual((rid, status), (i, 0))
+            self.assertEqual(data, self.data[i * size:][:size])
+        s.close()
+
+if __name__ == '__main__':
+    unittest.main()